@@ -37,6 +37,7 @@ int main()
 	sample->set_dimension(dimension);
 
 	size_t nsamples = 2000;
+	std::vector<std::vector<std::uint8_t>> points;
 	for(size_t i = 0; i != nsamples; i++)
 	{
 		std::vector<std::uint8_t> point(dimension);
@@ -45,9 +46,11 @@ int main()
 			std::uniform_int_distribution<int> grid_distr(0, grid[j] - 1);
 			point[j] = grid_distr(generator);
 		}
-		if(!sample->search(point))
-			sample->insert(point);
+		points.push_back(point);
 	}
+	// sorted keys are added without cloning or removing paths, duplicates are skipped
+	std::sort(points.begin(), points.end());
+	sample->insert_sorted(points);
 
 	mveqf::ImplicitQuantileMFSA<std::uint8_t, float> mveqfunc(lb, ub, grid);
 	mveqfunc.set_sample_shared_and_fill_count(sample);
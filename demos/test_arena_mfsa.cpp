@@ -0,0 +1,82 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <mveqf/implicit_mfsa.h>
+
+// the same transforms through an MFSA and an ArenaMFSA, the arena must give
+// the same values, with and without weights
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	std::uniform_int_distribution<int> grid_distr(2, 20);
+	size_t dimension = 8;
+
+	std::vector<size_t> grid(dimension);
+	for(auto & i : grid)
+		i = grid_distr(generator);
+	std::vector<float> lb(dimension, -1.0f);
+	std::vector<float> ub(dimension, 1.0f);
+
+	size_t nsamples = 5000;
+	std::vector<std::vector<std::uint8_t>> points;
+	std::vector<std::vector<float>> values;
+	std::vector<size_t> weights;
+	for(size_t i = 0; i != nsamples; i++)
+	{
+		std::vector<std::uint8_t> point(dimension);
+		std::vector<float> value(dimension);
+		for(size_t j = 0; j != point.size(); j++)
+		{
+			std::binomial_distribution<int> cell_distr(grid[j] - 1, 0.3);
+			point[j] = cell_distr(generator);
+			value[j] = lb[j] + (point[j] + 0.5f)*(ub[j] - lb[j])/grid[j];
+		}
+		points.push_back(point);
+		values.push_back(value);
+		weights.push_back(1 + i % 5);
+	}
+	std::sort(points.begin(), points.end());
+
+	auto sample = std::make_shared<mveqf::mfsa::MFSA<std::uint8_t>>();
+	sample->set_dimension(dimension);
+	sample->insert_sorted(points);
+	mveqf::ImplicitQuantileMFSA<std::uint8_t, float> reference(lb, ub, grid);
+	reference.set_sample_shared_and_fill_count(sample);
+
+	// sorted keys go straight into the arena, duplicates are counted once
+	auto arena = std::make_shared<mveqf::mfsa::ArenaMFSA<std::uint8_t>>();
+	arena->set_dimension(dimension);
+	for(const auto &i : points)
+		arena->insert(i);
+	mveqf::ImplicitQuantileArenaMFSA<std::uint8_t, float> quantile(lb, ub, grid);
+	quantile.set_sample_shared_and_fill_count(arena);
+
+	mveqf::ImplicitQuantileMFSA<std::uint8_t, float> weighted_reference(lb, ub, grid);
+	weighted_reference.set_sample(values, weights);
+	mveqf::ImplicitQuantileArenaMFSA<std::uint8_t, float> weighted(lb, ub, grid);
+	weighted.set_sample(values, weights);
+
+	std::uniform_real_distribution<float> ureal01(0.0f, 1.0f);
+	std::vector<float> values01(dimension);
+	std::vector<float> a(dimension), b(dimension), c(dimension), d(dimension);
+	std::vector<std::uint8_t> ia(dimension), ib(dimension);
+	size_t nsampled = 10000, mismatches = 0;
+	for(size_t i = 0; i != nsampled; i++)
+	{
+		for(auto & j : values01)
+			j = ureal01(generator);
+		reference.transform(values01, a);
+		quantile.transform(values01, b);
+		weighted_reference.transform(values01, c);
+		weighted.transform(values01, d);
+		reference.transform(values01, ia);
+		quantile.transform(values01, ib);
+		if(a != b || c != d || ia != ib)
+			++mismatches;
+	}
+	std::cout << "MFSA " << sample->get_node_count() << " states, ArenaMFSA " << arena->get_node_count() << " states" << std::endl;
+	std::cout << nsampled << " transforms, " << mismatches << " mismatches" << std::endl;
+	return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <mveqf/kde.h>
+
+// BinnedKDE::pdf against exact kernel sums over the sample moved to the cell
+// centres, with the bandwidth of the binned estimator, and against KDE::pdf
+// over the original sample for reference
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	std::normal_distribution<double> normal(0.0, 1.0);
+	size_t dimension = 2, nsamples = 20000, grid_size = 100;
+	std::vector<double> lb(dimension, -5.0), ub(dimension, 8.0);
+	const double width = (ub[0] - lb[0])/grid_size;
+
+	auto sample = std::make_shared<std::vector<std::vector<double>>>();
+	auto weights = std::make_shared<std::vector<size_t>>();
+	std::vector<std::vector<double>> snapped;
+	for(size_t i = 0; i != nsamples; i++)
+	{
+		std::vector<double> point(dimension), centre(dimension);
+		for(size_t j = 0; j != dimension; j++)
+		{
+			point[j] = normal(generator) + (i % 3 ? 3.0 : 0.0);
+			double k = std::floor((point[j] - lb[j])/width);
+			k = std::min(static_cast<double>(grid_size - 1), std::max(0.0, k));
+			centre[j] = lb[j] + width*(k + 0.5);
+		}
+		sample->push_back(point);
+		snapped.push_back(centre);
+		weights->push_back(1 + i % 3);
+	}
+
+	std::uniform_real_distribution<double> query_distr(-3.0, 6.0);
+	std::vector<std::vector<double>> queries(200, std::vector<double>(dimension));
+	for(auto & i : queries)
+		for(auto & j : i)
+			j = query_distr(generator);
+
+	mveqf::kde::Kernels<double> kernels;
+	bool ok = true;
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		mveqf::kde::KDE<double> exact;
+		exact.set_dimension(dimension);
+		exact.set_kernel_type(kernel);
+		exact.set_sample_shared(sample, weights);
+
+		// the gaussian and laplacian tails are cut far enough to be negligible
+		mveqf::kde::BinnedKDE<double> binned;
+		binned.set_dimension(dimension);
+		binned.set_kernel_type(kernel);
+		binned.set_grid(lb, ub, std::vector<size_t>(dimension, grid_size));
+		binned.set_cutoff(15.0);
+		binned.set_sample_shared(sample, weights);
+		const auto bandwidth = binned.get_bandwidth();
+
+		double max_pdf = 0.0, snapped_err = 0.0, exact_err = 0.0;
+		for(const auto &i : queries)
+		{
+			double reference = 0.0, total = 0.0;
+			for(size_t k = 0; k != snapped.size(); k++)
+			{
+				double t = (*weights)[k];
+				for(size_t j = 0; j != dimension; j++)
+					t *= kernels.compute_pdf(kernel, i[j], snapped[k][j], bandwidth[j]);
+				reference += t;
+				total += (*weights)[k];
+			}
+			reference /= total;
+			const double b = binned.pdf(i);
+			max_pdf = std::max(max_pdf, reference);
+			snapped_err = std::max(snapped_err, std::abs(b - reference));
+			exact_err = std::max(exact_err, std::abs(b - exact.pdf(i)));
+		}
+		const bool same = snapped_err <= 1e-6*max_pdf;
+		std::cout << "kernel " << kernel << ": " << binned.get_cell_count() << " cells, max pdf " << max_pdf << ", error " << snapped_err
+		          << " against the binned sample, " << exact_err << " against KDE::pdf" << (same ? "" : " - TOO LARGE") << std::endl;
+		ok = ok && same;
+	}
+	return ok ? 0 : 1;
+}
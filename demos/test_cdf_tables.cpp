@@ -0,0 +1,79 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <mveqf/kquantile.h>
+
+// smoothed transforms through precomputed cdf tables: the tables written by
+// save_cdf_tables and read back by load_cdf_tables must give the same values,
+// and the first coordinate must stay close to the direct inversion
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	size_t dimension = 3, grid_size = 64;
+	std::vector<size_t> grid(dimension, grid_size);
+	std::vector<double> lb(dimension, -1.0), ub(dimension, 1.0);
+	std::vector<double> bandwidth(dimension, 3.0*(ub[0] - lb[0])/grid_size);
+
+	auto sample = std::make_shared<mveqf::Trie<mveqf::NodeCount<int>, int>>(dimension);
+	std::normal_distribution<double> cell_distr(grid_size/2.0, grid_size/8.0);
+	for(size_t i = 0; i != 20000; i++)
+	{
+		std::vector<int> point(dimension);
+		for(auto &j : point)
+			j = static_cast<int>(std::min(grid_size - 1.0, std::max(0.0, cell_distr(generator))));
+		sample->insert(point);
+	}
+
+	std::uniform_real_distribution<double> ureal01(0.0, 1.0);
+	std::vector<std::vector<double>> values01(2000, std::vector<double>(dimension));
+	for(auto &i : values01)
+		for(auto &j : i)
+			j = ureal01(generator);
+
+	bool ok = true;
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		mveqf::ImplicitTrieKQuantile<int, double> direct(lb, ub, grid, kernel);
+		direct.set_sample_shared(sample);
+		direct.set_bandwidth(bandwidth);
+		direct.set_smoothing(true);
+
+		mveqf::ImplicitTrieKQuantile<int, double> cached(lb, ub, grid, kernel);
+		cached.set_sample_shared(sample);
+		cached.set_bandwidth(bandwidth);
+		cached.set_smoothing(true);
+		cached.precompute_cdf_tables(256, 1.0, 4096);
+		std::stringstream stream;
+		cached.save_cdf_tables(stream);
+		size_t tables = 0;
+		std::istringstream(stream.str()) >> tables;
+
+		mveqf::ImplicitTrieKQuantile<int, double> loaded(lb, ub, grid, kernel);
+		loaded.set_sample_shared(sample);
+		loaded.set_bandwidth(bandwidth);
+		loaded.set_smoothing(true);
+		loaded.load_cdf_tables(stream);
+
+		std::vector<double> a(dimension), b(dimension), c(dimension);
+		size_t mismatches = 0;
+		double max_diff = 0.0;
+		for(const auto &i : values01)
+		{
+			direct.transform(i, a);
+			cached.transform(i, b);
+			loaded.transform(i, c);
+			if(b != c)
+				++mismatches;
+			max_diff = std::max(max_diff, std::abs(a[0] - b[0]));
+		}
+		const bool same = mismatches == 0 && tables > 0 && max_diff <= 1e-5;
+		std::cout << "kernel " << kernel << ": " << tables << " tables, " << mismatches << " mismatches after loading, first coordinate within "
+		          << max_diff << " of the direct inversion" << (same ? "" : " - TOO LARGE") << std::endl;
+		ok = ok && same;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <set>
+#include <map>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <mveqf/trie_node.h>
+#include <mveqf/trie.h>
+#include <mveqf/mvff.h>
+
+// serial flood fill with the std::set bookkeeping of the original implementation:
+// +1 neighbours in samples and -1 neighbours already expanded are skipped, every
+// cell is evaluated once and the cells above the threshold are expanded in turn
+template <typename T>
+std::map<std::vector<int>, size_t> reference_fill(const std::vector<std::vector<T>> &grids,
+    const std::vector<std::vector<int>> &pp,
+    const mveqf::Trie<mveqf::NodeCount<int>,int> &samples,
+    const std::vector<T> &dx,
+    std::function<T(const std::vector<T> &)> f,
+    const T threshold,
+    const size_t multi)
+{
+	std::set<std::vector<int>> expanded(pp.begin(), pp.end());
+	std::set<std::vector<int>> evaluated;
+	std::map<std::vector<int>, T> found;
+	std::vector<std::vector<int>> stack(pp.begin(), pp.end());
+	auto evaluate = [&](const std::vector<int> &point)
+	{
+		if(!evaluated.insert(point).second)
+			return;
+		std::vector<T> values(point.size());
+		for(size_t j = 0; j != values.size(); j++)
+			values[j] = grids[j][point[j]] + dx[j];
+		T value = f(values);
+		if(value > threshold)
+		{
+			found[point] = value;
+			if(expanded.insert(point).second)
+				stack.push_back(point);
+		}
+	};
+	while(!stack.empty())
+	{
+		auto init_point = stack.back();
+		stack.pop_back();
+		for(size_t i = 0; i != init_point.size(); i++)
+		{
+			auto point = init_point;
+			point[i] = point[i] + 1;
+			if(point[i] <= static_cast<int>(grids[i].size() - 2) && !samples.search(point))
+				evaluate(point);
+		}
+		for(size_t i = 0; i != init_point.size(); i++)
+		{
+			auto point = init_point;
+			point[i] = point[i] - 1;
+			if(point[i] >= 0 && !expanded.count(point))
+				evaluate(point);
+		}
+	}
+
+	T min = std::numeric_limits<T>::max();
+	T max = std::numeric_limits<T>::min();
+	for(const auto &i : found)
+	{
+		min = std::min(min, i.second);
+		max = std::max(max, i.second);
+	}
+	std::map<std::vector<int>, size_t> res;
+	for(const auto &i : found)
+	{
+		if(!samples.search(i.first))
+			res[i.first] = multi*((i.second - min)/(max - min)) + 1;
+	}
+	if(res.empty())
+	{
+		for(const auto &i : pp)
+		{
+			if(!samples.search(i))
+				res[i] = 1;
+		}
+	}
+	return res;
+}
+
+void collect(const mveqf::NodeCount<int> *p, std::vector<int> &key, size_t dimension, std::map<std::vector<int>, size_t> &out)
+{
+	if(key.size() == dimension)
+	{
+		out[key] = p->count;
+		return;
+	}
+	for(const auto &i : p->children)
+	{
+		key.push_back(i->index);
+		collect(i, key, dimension, out);
+		key.pop_back();
+	}
+}
+
+// fills from the grid centre over a gaussian bump and compares the cells and
+// counts added to samples with the reference
+bool compare(size_t dimension, size_t grid_size, double width, double threshold, std::shared_ptr<mveqf::ThreadPool> pool)
+{
+	std::vector<std::vector<double>> grids(dimension, std::vector<double>(grid_size + 1));
+	std::vector<double> dx(dimension);
+	for(size_t i = 0; i != dimension; i++)
+	{
+		for(size_t j = 0; j <= grid_size; j++)
+			grids[i][j] = -1.0 + 2.0*j/grid_size;
+		dx[i] = 1.0/grid_size;
+	}
+	// two elongated bumps, the second one at x[0] = 0.3
+	std::function<double(const std::vector<double> &)> f = [width](const std::vector<double> &x)
+	{
+		double r1 = 0.0, r2 = 0.0;
+		for(size_t i = 0; i != x.size(); i++)
+		{
+			const double y = i == 0 ? x[i] - 0.3 : x[i];
+			r1 += x[i]*x[i]*(1.0 + 0.3*i);
+			r2 += y*y*(1.0 + 0.3*i);
+		}
+		return std::exp(-r1/width) + 0.8*std::exp(-r2/width);
+	};
+
+	// a few cells are sampled already, the fill passes through them without adding them
+	auto samples = std::make_shared<mveqf::Trie<mveqf::NodeCount<int>,int>>(dimension);
+	std::vector<int> centre(dimension, static_cast<int>(grid_size/2));
+	for(size_t i = 0; i != dimension; i++)
+	{
+		auto t = centre;
+		t[i] += 1;
+		samples->insert(t, 1);
+	}
+	std::vector<std::vector<int>> pp = {centre};
+
+	auto expected = reference_fill<double>(grids, pp, *samples, dx, f, threshold, 1000);
+	std::vector<int> key;
+	std::map<std::vector<int>, size_t> before;
+	collect(samples->root, key, dimension, before);
+	for(const auto &i : before)
+		expected.insert(i);
+
+	size_t counter = 0, fe_count = 0;
+	mveqf::mvff::FloodFill_MultipleGrids_VonNeumann_trie<double>(grids, pp, samples, dx, counter, fe_count, f, threshold, 1000, pool);
+	std::map<std::vector<int>, size_t> result;
+	collect(samples->root, key, dimension, result);
+
+	bool same = result == expected;
+	std::cout << dimension << "-d grid " << grid_size << ", " << (pool ? std::to_string(pool->size()) + " threads" : std::string("shared pool")) << ": " << result.size() << " cells, "
+	          << fe_count << " evaluations, " << (same ? "same as the reference" : "DIFFERENT from the reference") << std::endl;
+	return same;
+}
+
+int main()
+{
+	bool ok = true;
+	for(auto pool : {std::shared_ptr<mveqf::ThreadPool>(), std::make_shared<mveqf::ThreadPool>(4)})
+	{
+		// dense bitsets, hashed cell sets and cell ids handed out in order of appearance
+		ok = compare(2, 200, 0.1, 0.05, pool) && ok;
+		ok = compare(3, 60, 0.1, 0.02, pool) && ok;
+		ok = compare(5, 1000, 3e-5, 0.1, pool) && ok;
+		ok = compare(8, 250, 8e-4, 0.5, pool) && ok;
+	}
+
+	// an exception thrown by the density reaches the caller
+	std::vector<std::vector<double>> grids(2, std::vector<double>(41));
+	for(auto &i : grids)
+		for(size_t j = 0; j != i.size(); j++)
+			i[j] = -1.0 + 2.0*j/40;
+	std::vector<double> dx(2, 1.0/40);
+	auto samples = std::make_shared<mveqf::Trie<mveqf::NodeCount<int>,int>>(2);
+	std::vector<std::vector<int>> pp = {{20, 20}};
+	size_t counter = 0, fe_count = 0, calls = 0;
+	std::function<double(const std::vector<double> &)> f = [&calls](const std::vector<double> &)
+	{
+		if(++calls == 50)
+			throw std::runtime_error("density failed");
+		return 1.0;
+	};
+	try
+	{
+		mveqf::mvff::FloodFill_MultipleGrids_VonNeumann_trie<double>(grids, pp, samples, dx, counter, fe_count, f, 0.5, 1000, std::make_shared<mveqf::ThreadPool>(1));
+		std::cout << "the exception was lost" << std::endl;
+		ok = false;
+	}
+	catch(const std::runtime_error &e)
+	{
+		std::cout << "exception passed on: " << e.what() << std::endl;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <mveqf/kde.h>
+
+// KernelTable with linear and cubic interpolation against the exact kernels,
+// and KDE::cdf through the table against KDE::cdf with exact kernels
+int main()
+{
+	const double mu = 0.3, sigma = 0.7, lambda = 1.5;
+	const double tolerance[] = {0.0, 5e-5, 1e-8};
+	bool ok = true;
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		for(size_t interpolation = 1; interpolation != 3; interpolation++)
+		{
+			mveqf::kde::KernelTable<double> table(kernel, interpolation);
+			// errors relative to the kernel peak, sweeping past the table reach
+			const double peak = mveqf::kde::KernelTable<double>::exact_pdf(kernel, mu, mu, sigma, lambda);
+			double pdf_err = 0.0, cdf_err = 0.0;
+			const size_t n = 200000;
+			for(size_t i = 0; i <= n; i++)
+			{
+				const double x = mu + sigma*(-25.0 + 50.0*i/n);
+				pdf_err = std::max(pdf_err, std::abs(table.pdf(x, mu, sigma, lambda) - mveqf::kde::KernelTable<double>::exact_pdf(kernel, x, mu, sigma, lambda))/peak);
+				cdf_err = std::max(cdf_err, std::abs(table.cdf(x, mu, sigma, lambda) - mveqf::kde::KernelTable<double>::exact_cdf(kernel, x, mu, sigma, lambda)));
+			}
+			const bool close = pdf_err <= tolerance[interpolation] && cdf_err <= tolerance[interpolation];
+			std::cout << "kernel " << kernel << (interpolation == 1 ? ", linear" : ", cubic") << ": pdf error " << pdf_err
+			          << ", cdf error " << cdf_err << (close ? "" : " - TOO LARGE") << std::endl;
+			ok = ok && close;
+		}
+	}
+
+	std::mt19937_64 generator;
+	generator.seed(1);
+	std::normal_distribution<double> normal(0.0, 1.0);
+	size_t dimension = 2;
+	auto sample = std::make_shared<std::vector<std::vector<double>>>();
+	for(size_t i = 0; i != 2000; i++)
+		sample->push_back({normal(generator), 2.0*normal(generator)});
+	std::uniform_real_distribution<double> query_distr(-3.0, 3.0);
+	std::vector<std::vector<double>> queries(200, std::vector<double>(dimension));
+	for(auto & i : queries)
+		for(auto & j : i)
+			j = query_distr(generator);
+
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		mveqf::kde::KDE<double> kde;
+		kde.set_dimension(dimension);
+		kde.set_kernel_type(kernel);
+		kde.set_sample_shared(sample);
+		std::vector<double> expected;
+		for(const auto &i : queries)
+			expected.push_back(kde.cdf(i));
+		for(size_t interpolation = 1; interpolation != 3; interpolation++)
+		{
+			kde.set_interpolation(interpolation);
+			double err = 0.0;
+			for(size_t i = 0; i != queries.size(); i++)
+				err = std::max(err, std::abs(kde.cdf(queries[i]) - expected[i]));
+			const bool close = err <= tolerance[interpolation];
+			std::cout << "KDE::cdf, kernel " << kernel << (interpolation == 1 ? ", linear" : ", cubic") << ": error " << err << (close ? "" : " - TOO LARGE") << std::endl;
+			ok = ok && close;
+		}
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <mveqf/kde.h>
+
+// KDE::pdf_many and KDE::pdf_batch against a loop over KDE::pdf for every
+// kernel, with and without weights, support pruning and a thread pool
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	std::normal_distribution<double> normal(0.0, 1.0);
+	size_t dimension = 3, nsamples = 4000, nqueries = 200;
+
+	auto sample = std::make_shared<std::vector<std::vector<double>>>();
+	auto weights = std::make_shared<std::vector<size_t>>();
+	for(size_t i = 0; i != nsamples; i++)
+	{
+		std::vector<double> point(dimension);
+		for(auto & j : point)
+			j = normal(generator);
+		sample->push_back(point);
+		weights->push_back(1 + i % 3);
+	}
+
+	// row-major queries for pdf_many, the same points as vectors for pdf and pdf_batch
+	std::uniform_real_distribution<double> query_distr(-2.5, 2.5);
+	std::vector<double> flat(nqueries*dimension);
+	for(auto & i : flat)
+		i = query_distr(generator);
+	std::vector<std::vector<double>> queries(nqueries);
+	for(size_t i = 0; i != nqueries; i++)
+		queries[i].assign(flat.begin() + i*dimension, flat.begin() + (i + 1)*dimension);
+
+	auto pool = std::make_shared<mveqf::ThreadPool>(3);
+	bool ok = true;
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		for(int weighted = 0; weighted != 2; weighted++)
+		{
+			for(int pruning = 0; pruning != 2; pruning++)
+			{
+				mveqf::kde::KDE<double> kde;
+				kde.set_dimension(dimension);
+				kde.set_kernel_type(kernel);
+				kde.set_support_pruning(pruning);
+				if(weighted)
+					kde.set_sample_shared(sample, weights);
+				else
+					kde.set_sample_shared(sample);
+
+				std::vector<double> expected(nqueries);
+				for(size_t i = 0; i != nqueries; i++)
+					expected[i] = kde.pdf(queries[i]);
+
+				double max_rel = 0.0;
+				auto compare = [&](const std::vector<double> &res)
+				{
+					for(size_t i = 0; i != nqueries; i++)
+						max_rel = std::max(max_rel, std::abs(res[i] - expected[i])/(expected[i] + 1e-300));
+				};
+				std::vector<double> res(nqueries);
+				kde.pdf_many(flat.data(), nqueries, res.data());
+				compare(res);
+				compare(kde.pdf_batch(queries));
+				kde.set_thread_pool(pool);
+				kde.pdf_many(flat.data(), nqueries, res.data());
+				compare(res);
+				compare(kde.pdf_batch(queries));
+
+				const bool same = max_rel <= 1e-10;
+				std::cout << "kernel " << kernel << (weighted ? ", weighted" : "") << (pruning ? ", pruned" : "")
+				          << ": max relative error " << max_rel << (same ? "" : " - TOO LARGE") << std::endl;
+				ok = ok && same;
+			}
+		}
+	}
+	return ok ? 0 : 1;
+}
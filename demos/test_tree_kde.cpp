@@ -0,0 +1,65 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <mveqf/kde.h>
+
+// TreeKDE::pdf against the exact KDE::pdf on a weighted sample, the tree must
+// stay within its error bounds for every kernel
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	std::normal_distribution<double> normal(0.0, 1.0);
+	size_t dimension = 2, nsamples = 20000;
+
+	// two gaussian clusters, every point repeated one to four times
+	auto sample = std::make_shared<std::vector<std::vector<double>>>();
+	auto weights = std::make_shared<std::vector<size_t>>();
+	for(size_t i = 0; i != nsamples; i++)
+	{
+		std::vector<double> point(dimension);
+		for(auto & j : point)
+			j = normal(generator) + (i % 3 ? 3.0 : 0.0);
+		sample->push_back(point);
+		weights->push_back(1 + i % 4);
+	}
+
+	std::uniform_real_distribution<double> query_distr(-3.0, 6.0);
+	std::vector<std::vector<double>> queries(500, std::vector<double>(dimension));
+	for(auto & i : queries)
+		for(auto & j : i)
+			j = query_distr(generator);
+
+	const double abs_err = 1e-12, rel_err = 1e-3;
+	bool ok = true;
+	for(size_t kernel = 0; kernel != 6; kernel++)
+	{
+		mveqf::kde::KDE<double> exact;
+		exact.set_dimension(dimension);
+		exact.set_kernel_type(kernel);
+		exact.set_sample_shared(sample, weights);
+
+		mveqf::kde::TreeKDE<double> tree;
+		tree.set_dimension(dimension);
+		tree.set_kernel_type(kernel);
+		tree.set_error_bounds(abs_err, rel_err);
+		tree.set_sample_shared(sample, weights);
+
+		size_t violations = 0;
+		double worst = 0.0;
+		for(const auto &i : queries)
+		{
+			const double a = exact.pdf(i);
+			const double b = tree.pdf(i);
+			const double err = std::abs(a - b);
+			// the error as a fraction of the allowed one
+			worst = std::max(worst, err/(abs_err + rel_err*a));
+			if(err > abs_err + rel_err*a)
+				++violations;
+		}
+		std::cout << "kernel " << kernel << ": " << tree.get_node_count() << " nodes, worst error " << worst << " of the bound, " << violations << " violations" << std::endl;
+		ok = ok && violations == 0;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <mveqf/implicit.h>
+#include <mveqf/implicit_mfsa.h>
+
+// a finished TrieBased converted by ArenaMFSA::build must give the same
+// transforms as the trie itself
+int main()
+{
+	std::mt19937_64 generator;
+	generator.seed(1);
+	size_t dimension = 6;
+	std::vector<size_t> grid(dimension, 16);
+	std::vector<double> lb(dimension, 0.0);
+	std::vector<double> ub(dimension, 1.0);
+
+	auto trie = std::make_shared<mveqf::TrieBased<mveqf::NodeCount<std::uint8_t>, std::uint8_t>>(dimension);
+	std::normal_distribution<double> cell_distr(8.0, 2.5);
+	for(size_t i = 0; i != 20000; i++)
+	{
+		std::vector<std::uint8_t> point(dimension);
+		for(auto &j : point)
+			j = static_cast<std::uint8_t>(std::min(15.0, std::max(0.0, cell_distr(generator))));
+		trie->insert(point);
+	}
+
+	// the counts are copied, so an uncounted trie is refused
+	bool refused = false;
+	try
+	{
+		mveqf::mfsa::ArenaMFSA<std::uint8_t> arena;
+		arena.build(*trie);
+	}
+	catch(const std::logic_error &)
+	{
+		refused = true;
+	}
+	trie->fill_tree_count();
+
+	auto arena = std::make_shared<mveqf::mfsa::ArenaMFSA<std::uint8_t>>();
+	arena->build(*trie);
+
+	mveqf::ImplicitQuantile<std::uint8_t, double> reference(lb, ub, grid);
+	reference.set_sample_shared(trie);
+	mveqf::ImplicitQuantileArenaMFSA<std::uint8_t, double> quantile(lb, ub, grid);
+	quantile.set_sample_shared(arena);
+
+	std::uniform_real_distribution<double> ureal01(0.0, 1.0);
+	std::vector<double> values01(dimension), a(dimension), b(dimension);
+	size_t nsampled = 10000, mismatches = 0;
+	for(size_t i = 0; i != nsampled; i++)
+	{
+		for(auto &j : values01)
+			j = ureal01(generator);
+		reference.transform(values01, a);
+		quantile.transform(values01, b);
+		if(a != b)
+			++mismatches;
+	}
+	std::cout << "TrieBased " << trie->get_node_count() << " nodes, ArenaMFSA " << arena->get_node_count() << " states" << std::endl;
+	std::cout << "uncounted trie " << (refused ? "refused" : "ACCEPTED") << ", " << nsampled << " transforms, " << mismatches << " mismatches" << std::endl;
+	return refused && mismatches == 0 ? 0 : 1;
+}
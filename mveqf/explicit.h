@@ -20,8 +20,161 @@
 
 #include <mveqf/quantile.h>
 
+#include <list>
+#include <map>
+#include <mutex>
+
 namespace mveqf
 {
+	template <typename TFloat>
+	class ColumnSample
+	{
+	public:
+		ColumnSample();
+		explicit ColumnSample(size_t dim);
+		explicit ColumnSample(const std::vector<std::vector<TFloat>> &rows);
+		void set_dimension(size_t dim);
+		size_t get_dimension() const;
+		size_t size() const;
+		bool empty() const;
+		void reserve(size_t n);
+		void push_back(const std::vector<TFloat> &row);
+		void push_back(const std::vector<TFloat> &row, size_t weight);
+		void add_weight(size_t row, size_t weight);
+		std::vector<TFloat> get_row(size_t row) const;
+		const TFloat *column(size_t ind) const;
+		const size_t *get_weights() const;
+		TFloat at(size_t row, size_t ind) const;
+		size_t get_weight(size_t row) const;
+		size_t get_total_weight() const;
+	protected:
+		// one contiguous column per dimension
+		std::vector<std::vector<TFloat>> columns;
+		// multiplicity of each row, a weighted point is stored once
+		std::vector<size_t> weights;
+		size_t count;
+		size_t total_weight;
+	};
+
+	template <typename TFloat>
+	ColumnSample<TFloat>::ColumnSample() : count(0), total_weight(0)
+	{
+	}
+
+	template <typename TFloat>
+	ColumnSample<TFloat>::ColumnSample(size_t dim) : columns(dim), count(0), total_weight(0)
+	{
+	}
+
+	template <typename TFloat>
+	ColumnSample<TFloat>::ColumnSample(const std::vector<std::vector<TFloat>> &rows) : count(0), total_weight(0)
+	{
+		if(!rows.empty())
+			set_dimension(rows.front().size());
+		reserve(rows.size());
+		for(const auto &i : rows)
+			push_back(i);
+	}
+
+	template <typename TFloat>
+	void ColumnSample<TFloat>::set_dimension(size_t dim)
+	{
+		columns.assign(dim, std::vector<TFloat>());
+		weights.clear();
+		count = 0;
+		total_weight = 0;
+	}
+
+	template <typename TFloat>
+	size_t ColumnSample<TFloat>::get_dimension() const
+	{
+		return columns.size();
+	}
+
+	template <typename TFloat>
+	size_t ColumnSample<TFloat>::size() const
+	{
+		return count;
+	}
+
+	template <typename TFloat>
+	bool ColumnSample<TFloat>::empty() const
+	{
+		return count == 0;
+	}
+
+	template <typename TFloat>
+	void ColumnSample<TFloat>::reserve(size_t n)
+	{
+		for(auto &i : columns)
+			i.reserve(n);
+		weights.reserve(n);
+	}
+
+	template <typename TFloat>
+	void ColumnSample<TFloat>::push_back(const std::vector<TFloat> &row)
+	{
+		push_back(row, 1);
+	}
+
+	template <typename TFloat>
+	void ColumnSample<TFloat>::push_back(const std::vector<TFloat> &row, size_t weight)
+	{
+		if(row.size() != columns.size())
+			throw std::logic_error("row.size() != dimension");
+		for(size_t j = 0; j != row.size(); j++)
+			columns[j].push_back(row[j]);
+		weights.push_back(weight);
+		total_weight += weight;
+		++count;
+	}
+
+	template <typename TFloat>
+	void ColumnSample<TFloat>::add_weight(size_t row, size_t weight)
+	{
+		weights[row] += weight;
+		total_weight += weight;
+	}
+
+	template <typename TFloat>
+	std::vector<TFloat> ColumnSample<TFloat>::get_row(size_t row) const
+	{
+		std::vector<TFloat> res(columns.size());
+		for(size_t j = 0; j != columns.size(); j++)
+			res[j] = columns[j][row];
+		return res;
+	}
+
+	template <typename TFloat>
+	const TFloat *ColumnSample<TFloat>::column(size_t ind) const
+	{
+		return columns[ind].data();
+	}
+
+	template <typename TFloat>
+	const size_t *ColumnSample<TFloat>::get_weights() const
+	{
+		return weights.data();
+	}
+
+	template <typename TFloat>
+	TFloat ColumnSample<TFloat>::at(size_t row, size_t ind) const
+	{
+		return columns[ind][row];
+	}
+
+	template <typename TFloat>
+	size_t ColumnSample<TFloat>::get_weight(size_t row) const
+	{
+		return weights[row];
+	}
+
+	template <typename TFloat>
+	size_t ColumnSample<TFloat>::get_total_weight() const
+	{
+		return total_weight;
+	}
+
 	template <typename TIndex, typename TFloat>
 	class ExplicitQuantile : public Quantile<TIndex, TFloat>
 	{
@@ -35,11 +188,35 @@ namespace mveqf
 
 		using Quantile<TIndex, TFloat>::get_grid_value;
 
-		typedef std::vector<std::vector<TFloat>> sample_type;
+		typedef ColumnSample<TFloat> sample_type;
 		std::shared_ptr<sample_type> sample;
 
-		size_t count_less(const std::vector<TFloat> &layer, TFloat target) const;
-		std::pair<size_t, TFloat> quantile_transform(const std::vector<TFloat> &layer, size_t ind, TFloat val01) const;
+		// rows of the prefix cell m[0..ind), their ind-th components and weights;
+		// sorted layers keep running sums in weights, weights[k] is the mass of values[0..k)
+		struct cell_layer
+		{
+			std::vector<size_t> rows;
+			std::vector<TFloat> values;
+			std::vector<size_t> weights;
+			size_t total = 0;
+			bool sorted = false;
+		};
+		typedef std::list<std::pair<std::vector<size_t>, std::shared_ptr<const cell_layer>>> cache_list_type;
+
+		size_t cache_capacity = 0;
+		mutable cache_list_type cache_list;
+		mutable std::map<std::vector<size_t>, typename cache_list_type::iterator> cache_map;
+		mutable size_t cache_hits = 0;
+		mutable size_t cache_misses = 0;
+		mutable std::mutex cache_mutex;
+
+		std::shared_ptr<const cell_layer> get_layer(const std::vector<size_t> &m, size_t ind, const std::shared_ptr<const cell_layer> &parent) const;
+		virtual void prepare_layer(cell_layer &layer) const;
+		void filter_rows(const std::vector<size_t> &rows, size_t ind, size_t cell, std::vector<size_t> &out) const;
+		void fill_layer(size_t ind, cell_layer &layer) const;
+		void insert_row(std::map<std::vector<TFloat>, size_t> &rows, const std::vector<TFloat> &row, size_t weight);
+		virtual size_t count_less(const cell_layer &layer, TFloat target) const;
+		std::pair<size_t, TFloat> quantile_transform(const cell_layer &layer, size_t ind, TFloat val01) const;
 
 		size_t get_lower_bound(size_t ind, const TFloat &value) const;
 	public:
@@ -47,13 +224,18 @@ namespace mveqf
 		ExplicitQuantile(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
 		ExplicitQuantile(const ExplicitQuantile&) = delete;
 		ExplicitQuantile& operator=(const ExplicitQuantile&) = delete;
-		using Quantile<TIndex, TFloat>::set_grid_and_gridn;
+		void set_grid_and_gridn(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
 		void set_sample(const std::vector<std::vector<TIndex>> &in_sample) override;
 		void set_sample(const std::vector<std::vector<TFloat>> &in_sample) override;
 		void set_sample(const std::vector<std::vector<TFloat>> &in_sample, const std::vector<size_t> &weights) override;
 		void set_sample_shared(std::shared_ptr<sample_type> in_sample);
+		void set_sample_shared(std::shared_ptr<std::vector<std::vector<TFloat>>> in_sample);
 		void transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const override;
 		void transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const override;
+		void set_cache_size(size_t n);
+		void clear_cache();
+		size_t get_cache_hits() const;
+		size_t get_cache_misses() const;
 		using Quantile<TIndex, TFloat>::get_the_closest_grid_node_to_the_value;
 		~ExplicitQuantile();
 	};
@@ -73,7 +255,9 @@ namespace mveqf
 	template <typename TIndex, typename TFloat>
 	void ExplicitQuantile<TIndex, TFloat>::set_sample(const std::vector<std::vector<TIndex>> &in_sample)
 	{
-		sample = std::make_shared< std::vector<std::vector<TFloat>> >();
+		clear_cache();
+		sample = std::make_shared<sample_type>(grid_number.size());
+		std::map<std::vector<TFloat>, size_t> rows;
 		for(size_t i = 0; i != in_sample.size(); ++i)
 		{
 			std::vector<TFloat> temp;
@@ -82,14 +266,16 @@ namespace mveqf
 				//temp.push_back(grids[j][in_sample[i][j]] + dx[j]);
 				temp.push_back(get_grid_value(j, in_sample[i][j]) + dx[j]);
 			}
-			sample->push_back(temp);
+			insert_row(rows, temp, 1);
 		}
 	}
 
 	template <typename TIndex, typename TFloat>
 	void ExplicitQuantile<TIndex, TFloat>::set_sample(const std::vector<std::vector<TFloat>> &in_sample)
 	{
-		sample = std::make_shared< std::vector<std::vector<TFloat>> >();
+		clear_cache();
+		sample = std::make_shared<sample_type>(grid_number.size());
+		std::map<std::vector<TFloat>, size_t> rows;
 		for(size_t i = 0; i != in_sample.size(); ++i)
 		{
 			std::vector<TFloat> temp;
@@ -98,14 +284,16 @@ namespace mveqf
 				TIndex index = get_the_closest_grid_node_to_the_value(lb[j], ub[j], grid_number[j], in_sample[i][j]);
 				temp.push_back(get_grid_value(j, index) + dx[j]);
 			}
-			sample->push_back(temp);
+			insert_row(rows, temp, 1);
 		}
 	}
 
 	template <typename TIndex, typename TFloat>
 	void ExplicitQuantile<TIndex, TFloat>::set_sample(const std::vector<std::vector<TFloat>> &in_sample, const std::vector<size_t> &weights)
 	{
-		sample = std::make_shared< std::vector<std::vector<TFloat>> >();
+		clear_cache();
+		sample = std::make_shared<sample_type>(grid_number.size());
+		std::map<std::vector<TFloat>, size_t> rows;
 		for(size_t i = 0; i != in_sample.size(); ++i)
 		{
 			std::vector<TFloat> temp;
@@ -114,17 +302,84 @@ namespace mveqf
 				TIndex index = get_the_closest_grid_node_to_the_value(lb[j], ub[j], grid_number[j], in_sample[i][j]);
 				temp.push_back(get_grid_value(j, index) + dx[j]);
 			}
-			for(size_t j = 0; j != weights[i]; j++)
-				sample->push_back(temp);
+			if(weights[i] > 0)
+				insert_row(rows, temp, weights[i]);
+		}
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::insert_row(std::map<std::vector<TFloat>, size_t> &rows, const std::vector<TFloat> &row, size_t weight)
+	{
+		// points snapped to the same grid node are stored once with the summed weight
+		auto it = rows.find(row);
+		if(it != rows.end())
+		{
+			sample->add_weight(it->second, weight);
+		}
+		else
+		{
+			rows.insert(std::make_pair(row, sample->size()));
+			sample->push_back(row, weight);
 		}
 	}
 
 	template <typename TIndex, typename TFloat>
 	void ExplicitQuantile<TIndex, TFloat>::set_sample_shared(std::shared_ptr<sample_type> in_sample)
 	{
+		clear_cache();
 		sample = std::move(in_sample);
 	}
 
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::set_sample_shared(std::shared_ptr<std::vector<std::vector<TFloat>>> in_sample)
+	{
+		clear_cache();
+		sample = std::make_shared<sample_type>(*in_sample);
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::set_grid_and_gridn(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn)
+	{
+		clear_cache();
+		Quantile<TIndex, TFloat>::set_grid_and_gridn(in_lb, in_ub, in_gridn);
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::set_cache_size(size_t n)
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		cache_capacity = n;
+		while(cache_list.size() > cache_capacity)
+		{
+			cache_map.erase(cache_list.back().first);
+			cache_list.pop_back();
+		}
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::clear_cache()
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		cache_list.clear();
+		cache_map.clear();
+		cache_hits = 0;
+		cache_misses = 0;
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ExplicitQuantile<TIndex, TFloat>::get_cache_hits() const
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		return cache_hits;
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ExplicitQuantile<TIndex, TFloat>::get_cache_misses() const
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		return cache_misses;
+	}
+
 	template <typename TIndex, typename TFloat>
 	size_t ExplicitQuantile<TIndex, TFloat>::get_lower_bound(size_t ind, const TFloat &value) const
 	{
@@ -152,32 +407,13 @@ namespace mveqf
 	void ExplicitQuantile<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const
 	{
 		std::vector<size_t> m(grid_number.size());
+		std::shared_ptr<const cell_layer> layer;
 		for(size_t i = 0, g = in01.size(); i != g; i++)
 		{
-			std::vector<TFloat> row(sample->size());
-			size_t index = 0;
-			for(size_t j = 0, n = sample->size(); j != n; j++)
-			{
-				bool flag = true;
-				for(size_t k = 0; k != i; k++)
-				{
-					//if(!((*sample)[j][k] > grids[k][m[k]] && (*sample)[j][k] < grids[k][m[k] + 1]))
-					if(!((*sample)[j][k] > get_grid_value(k, m[k]) && (*sample)[j][k] < get_grid_value(k, m[k] + 1)))
-					{
-						flag = false;
-						break;
-					}
-				}
-				if(flag)
-				{
-					row[index] = (*sample)[j][i];
-					++index;
-				}
-			}
-			row.resize(index);
+			layer = get_layer(m, i, layer);
 
 //			std::tie(m[i], out[i]) = quantile_transform(row, i, in01[i]);
-			auto [k, res] = quantile_transform(row, i, in01[i]);
+			auto [k, res] = quantile_transform(*layer, i, in01[i]);
 			out[i] = res;
 			m[i] = k;
 		}
@@ -187,51 +423,124 @@ namespace mveqf
 	void ExplicitQuantile<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const
 	{
 		std::vector<size_t> m(grid_number.size());
+		std::shared_ptr<const cell_layer> layer;
 		for(size_t i = 0, g = in01.size(); i != g; i++)
 		{
-			std::vector<TFloat> row(sample->size());
-			size_t index = 0;
-			for(size_t j = 0, n = sample->size(); j != n; j++)
+			layer = get_layer(m, i, layer);
+
+//			std::tie(m[i], out[i]) = quantile_transform(row, i, in01[i]);
+			auto [k, res] = quantile_transform(*layer, i, in01[i]);
+			out[i] = k;
+			m[i] = k;
+		}
+	}
+
+	template <typename TIndex, typename TFloat>
+	std::shared_ptr<const typename ExplicitQuantile<TIndex, TFloat>::cell_layer> ExplicitQuantile<TIndex, TFloat>::get_layer(const std::vector<size_t> &m,
+	    size_t ind,
+	    const std::shared_ptr<const cell_layer> &parent) const
+	{
+		std::vector<size_t> prefix;
+		if(cache_capacity > 0)
+		{
+			prefix.assign(m.begin(), m.begin() + ind);
+			std::lock_guard<std::mutex> lock(cache_mutex);
+			auto it = cache_map.find(prefix);
+			if(it != cache_map.end())
 			{
-				bool flag = true;
-				for(size_t k = 0; k != i; k++)
-				{
-					//if(!((*sample)[j][k] > grids[k][m[k]] && (*sample)[j][k] < grids[k][m[k] + 1]))
-					if(!((*sample)[j][k] > get_grid_value(k, m[k]) && (*sample)[j][k] < get_grid_value(k, m[k] + 1)))
-					{
-						flag = false;
-						break;
-					}
-				}
-				if(flag)
+				++cache_hits;
+				cache_list.splice(cache_list.begin(), cache_list, it->second);
+				return it->second->second;
+			}
+			++cache_misses;
+		}
+
+		auto layer = std::make_shared<cell_layer>();
+		if(parent == nullptr)
+		{
+			layer->rows.resize(sample->size());
+			std::iota(layer->rows.begin(), layer->rows.end(), 0);
+		}
+		else
+		{
+			filter_rows(parent->rows, ind - 1, m[ind - 1], layer->rows);
+		}
+		fill_layer(ind, *layer);
+		prepare_layer(*layer);
+
+		if(cache_capacity > 0)
+		{
+			std::lock_guard<std::mutex> lock(cache_mutex);
+			if(cache_map.find(prefix) == cache_map.end())
+			{
+				cache_list.emplace_front(prefix, layer);
+				cache_map.insert(std::make_pair(prefix, cache_list.begin()));
+				while(cache_list.size() > cache_capacity)
 				{
-					row[index] = (*sample)[j][i];
-					++index;
+					cache_map.erase(cache_list.back().first);
+					cache_list.pop_back();
 				}
 			}
-			row.resize(index);
+		}
+		return layer;
+	}
 
-//			std::tie(m[i], out[i]) = quantile_transform(row, i, in01[i]);
-			auto [k, res] = quantile_transform(row, i, in01[i]);
-			out[i] = k;
-			m[i] = k;
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::prepare_layer(cell_layer &layer) const
+	{
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantile<TIndex, TFloat>::filter_rows(const std::vector<size_t> &rows, size_t ind, size_t cell, std::vector<size_t> &out) const
+	{
+		// keeps the rows whose ind-th component lies inside the chosen cell,
+		// rows stay in increasing order so the column is read front to back
+		const TFloat *col = sample->column(ind);
+		const TFloat left = get_grid_value(ind, cell);
+		const TFloat right = get_grid_value(ind, cell + 1);
+		out.clear();
+		for(size_t j = 0, n = rows.size(); j != n; j++)
+		{
+			const TFloat v = col[rows[j]];
+			if(v > left && v < right)
+				out.push_back(rows[j]);
 		}
 	}
 
 	template <typename TIndex, typename TFloat>
-	size_t ExplicitQuantile<TIndex, TFloat>::count_less(const std::vector<TFloat> &layer, TFloat target) const
+	void ExplicitQuantile<TIndex, TFloat>::fill_layer(size_t ind, cell_layer &layer) const
 	{
-		return std::count_if(layer.begin(), layer.end(), [&](const TFloat &v)
+		const TFloat *col = sample->column(ind);
+		const size_t *w = sample->get_weights();
+		const size_t n = layer.rows.size();
+		layer.values.resize(n);
+		layer.weights.resize(n);
+		layer.total = 0;
+		for(size_t j = 0; j != n; j++)
 		{
-			return v < target;
-		});
+			layer.values[j] = col[layer.rows[j]];
+			layer.weights[j] = w[layer.rows[j]];
+			layer.total += layer.weights[j];
+		}
 	}
 
 	template <typename TIndex, typename TFloat>
-	std::pair<size_t, TFloat> ExplicitQuantile<TIndex, TFloat>::quantile_transform(const std::vector<TFloat> &layer, size_t ind, TFloat val01) const
+	size_t ExplicitQuantile<TIndex, TFloat>::count_less(const cell_layer &layer, TFloat target) const
+	{
+		size_t res = 0;
+		for(size_t j = 0, n = layer.values.size(); j != n; j++)
+		{
+			if(layer.values[j] < target)
+				res += layer.weights[j];
+		}
+		return res;
+	}
+
+	template <typename TIndex, typename TFloat>
+	std::pair<size_t, TFloat> ExplicitQuantile<TIndex, TFloat>::quantile_transform(const cell_layer &layer, size_t ind, TFloat val01) const
 	{
 		size_t count = grid_number[ind], step, c1 = 0, c2 = 0, m = 0;
-		TFloat f1 = 0.0, f2 = 0.0, n = layer.size();
+		TFloat f1 = 0.0, f2 = 0.0, n = layer.total;
 		//auto first = grids[ind].begin();
 		//auto it = grids[ind].begin();
 		size_t it = 0, first = 0;
@@ -272,15 +581,15 @@ namespace mveqf
 		{
 			if(c1 == 0)
 			{
-				auto min_val = *std::min_element(layer.begin(), layer.end()) - 2.0*dx[ind];
+				auto min_val = *std::min_element(layer.values.begin(), layer.values.end()) - 2.0*dx[ind];
 				//auto lb_min = std::lower_bound(grids[ind].begin(), grids[ind].end(), min_val);
 				//size_t min_ind = std::distance(grids[ind].begin(), lb_min);
 				size_t min_ind = get_lower_bound(ind, min_val);
 				return std::make_pair(min_ind, get_grid_value(ind, min_ind) + 2.0*val01*dx[ind]);
 			}
-			if(c1 == layer.size())
+			if(c1 == layer.total)
 			{
-				auto max_val = *std::max_element(layer.begin(), layer.end()) - 2.0*dx[ind];
+				auto max_val = *std::max_element(layer.values.begin(), layer.values.end()) - 2.0*dx[ind];
 				//auto lb_max = std::lower_bound(grids[ind].begin(), grids[ind].end(), max_val);
 				//size_t max_ind = std::distance(grids[ind].begin(), lb_max);
 				size_t max_ind = get_lower_bound(ind, max_val);
@@ -290,9 +599,9 @@ namespace mveqf
 			TFloat target = get_grid_value(ind, m);
 			TFloat diff = std::numeric_limits<TFloat>::max();
 			size_t index = 0;
-			for(size_t i = 1; i != layer.size(); ++i)
+			for(size_t i = 0; i != layer.values.size(); ++i)
 			{
-				TFloat curr = std::abs(layer[i] - target);
+				TFloat curr = std::abs(layer.values[i] - target);
 				if(diff > curr)
 				{
 					diff = curr;
@@ -302,12 +611,70 @@ namespace mveqf
 
 			//auto lb = std::lower_bound(grids[ind].begin(), grids[ind].end(), layer[index] - 2.0*dx[ind]);
 			//size_t lb_ind = std::distance(grids[ind].begin(), lb);
-			size_t lb_ind = get_lower_bound(ind, layer[index] - 2.0*dx[ind]);
+			size_t lb_ind = get_lower_bound(ind, layer.values[index] - 2.0*dx[ind]);
 			return std::make_pair(lb_ind, get_grid_value(ind, lb_ind) + 2.0*val01*dx[ind]);
 		}
 		//return std::make_pair(m, grids[ind][m] + (val01 - f1) * (grids[ind][m + 1] - grids[ind][m]) / (f2 - f1));
 		return std::make_pair(m, get_grid_value(ind, m) + (val01 - f1) * (get_grid_value(ind, m + 1) - get_grid_value(ind, m)) / (f2 - f1));
 	}
+
+	// count_less by binary search over sorted layers with running sums of the
+	// weights. Sorting costs more than the linear scans of a single transform, so
+	// only layers kept in the cache (set_cache_size) are sorted
+	template <typename TIndex, typename TFloat>
+	class ExplicitQuantileSorted : public ExplicitQuantile<TIndex, TFloat>
+	{
+	protected:
+		using ExplicitQuantile<TIndex, TFloat>::cache_capacity;
+		using cell_layer = typename ExplicitQuantile<TIndex, TFloat>::cell_layer;
+
+		void prepare_layer(cell_layer &layer) const override;
+		size_t count_less(const cell_layer &layer, TFloat target) const override;
+	public:
+		ExplicitQuantileSorted() = default;
+		ExplicitQuantileSorted(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
+		ExplicitQuantileSorted(const ExplicitQuantileSorted&) = delete;
+		ExplicitQuantileSorted& operator=(const ExplicitQuantileSorted&) = delete;
+	};
+
+	template <typename TIndex, typename TFloat>
+	ExplicitQuantileSorted<TIndex, TFloat>::ExplicitQuantileSorted(std::vector<TFloat> in_lb,
+	    std::vector<TFloat> in_ub,
+	    std::vector<size_t> in_gridn): ExplicitQuantile<TIndex, TFloat>(in_lb, in_ub, in_gridn)
+	{
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ExplicitQuantileSorted<TIndex, TFloat>::prepare_layer(cell_layer &layer) const
+	{
+		if(cache_capacity == 0)
+			return;
+		const size_t n = layer.values.size();
+		std::vector<size_t> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&layer](size_t l, size_t r)
+		{
+			return layer.values[l] < layer.values[r];
+		});
+		std::vector<TFloat> values(n);
+		std::vector<size_t> psum(n + 1, 0);
+		for(size_t j = 0; j != n; j++)
+		{
+			values[j] = layer.values[order[j]];
+			psum[j + 1] = psum[j] + layer.weights[order[j]];
+		}
+		layer.values = std::move(values);
+		layer.weights = std::move(psum);
+		layer.sorted = true;
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ExplicitQuantileSorted<TIndex, TFloat>::count_less(const cell_layer &layer, TFloat target) const
+	{
+		if(!layer.sorted)
+			return ExplicitQuantile<TIndex, TFloat>::count_less(layer, target);
+		return layer.weights[std::distance(layer.values.begin(), std::lower_bound(layer.values.begin(), layer.values.end(), target))];
+	}
 }
 
 #endif
@@ -18,18 +18,24 @@
 #ifndef IMPLICIT_MFSA_H
 #define IMPLICIT_MFSA_H
 
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
 #include <mveqf/quantile.h>
 #include <mveqf/mfsa.h>
 
 namespace mveqf
 {
-	template <typename TIndex, typename TFloat>
-	class ImplicitQuantileMFSA : public Quantile<TIndex, TFloat>
+	// quantile transform over a minimised automaton. TAutomaton derives from it
+	// and exposes the states of its automaton, the count below a state and its
+	// edges, through get_root, get_count, get_size, get_label, get_target and
+	// count_less; build(keys, weights) makes and counts a new automaton from
+	// sorted keys, no weights means every distinct key is counted once. The
+	// calls are resolved statically
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	class ImplicitQuantileAutomaton : public Quantile<TIndex, TFloat>
 	{
 	protected:
-		typedef mveqf::mfsa::MFSA<TIndex> sample_type;
-		std::shared_ptr<sample_type> sample;
-
 		//using Quantile<TIndex, TFloat>::grids;
 		using Quantile<TIndex, TFloat>::grid_number;
 		using Quantile<TIndex, TFloat>::dx;
@@ -38,71 +44,54 @@ namespace mveqf
 
 		using Quantile<TIndex, TFloat>::get_grid_value;
 
-		std::pair<size_t, size_t> count_less(mfsa::Node<TIndex> *layer, const size_t &r) const;
-		std::pair<size_t, TFloat> quantile_transform(mfsa::Node<TIndex> *layer, size_t ind, TFloat val01) const;
+		const TAutomaton &automaton() const
+		{
+			return static_cast<const TAutomaton&>(*this);
+		}
+		TAutomaton &automaton()
+		{
+			return static_cast<TAutomaton&>(*this);
+		}
+
+		std::pair<size_t, TFloat> quantile_transform(TState layer, size_t ind, TFloat val01) const;
 	public:
-		ImplicitQuantileMFSA() = default;
-		ImplicitQuantileMFSA(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
-		ImplicitQuantileMFSA(const ImplicitQuantileMFSA&) = delete;
-		ImplicitQuantileMFSA& operator=(const ImplicitQuantileMFSA&) = delete;
+		ImplicitQuantileAutomaton() = default;
+		ImplicitQuantileAutomaton(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
 		void set_sample(const std::vector<std::vector<TIndex>> &in_sample) override;
 		void set_sample(const std::vector<std::vector<TFloat>> &in_sample) override;
 		void set_sample(const std::vector<std::vector<TFloat>> &in_sample, const std::vector<size_t> &weights) override;
 		void set_sample_and_fill_count(const std::vector<std::vector<TIndex>> &in_sample);
-		void set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample);
-		void set_sample_shared(std::shared_ptr<sample_type> in_sample);
 		void transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const override;
 		void transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const override;
-		size_t get_node_count() const;
-		size_t get_link_count() const;
 		using Quantile<TIndex, TFloat>::get_the_closest_grid_node_to_the_value;
 		using Quantile<TIndex, TFloat>::get_real_node_values;
-		~ImplicitQuantileMFSA();
 	};
 
-	template <typename TIndex, typename TFloat>
-	ImplicitQuantileMFSA<TIndex, TFloat>::ImplicitQuantileMFSA(std::vector<TFloat> in_lb,
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::ImplicitQuantileAutomaton(std::vector<TFloat> in_lb,
 	    std::vector<TFloat> in_ub,
 	    std::vector<size_t> in_gridn) : Quantile<TIndex, TFloat>(in_lb, in_ub, in_gridn)
 	{}
 
-	template <typename TIndex, typename TFloat>
-	ImplicitQuantileMFSA<TIndex, TFloat>::~ImplicitQuantileMFSA()
-	{}
-
-	template <typename TIndex, typename TFloat>
-	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_node_count() const
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::set_sample_and_fill_count(const std::vector<std::vector<TIndex>> &in_sample)
 	{
-		return sample->get_node_count();
+		std::vector<std::vector<TIndex>> keys(in_sample);
+		std::sort(keys.begin(), keys.end());
+		automaton().build(keys, std::vector<size_t>());
 	}
 
-	template <typename TIndex, typename TFloat>
-	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_link_count() const
-	{
-		return sample->get_link_count();
-	}
-
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample_and_fill_count(const std::vector<std::vector<TIndex>> &in_sample)
-	{
-		sample = std::make_shared<sample_type>();
-		sample->set_dimension(grid_number.size());
-		for(const auto & i : in_sample)
-			sample->insert(i);
-		sample->fill_tree_count();
-	}
-
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample(const std::vector<std::vector<TIndex>> &in_sample)
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::set_sample(const std::vector<std::vector<TIndex>> &in_sample)
 	{
 		set_sample_and_fill_count(in_sample);
 	}
 
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample(const std::vector<std::vector<TFloat>> &in_sample)
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::set_sample(const std::vector<std::vector<TFloat>> &in_sample)
 	{
-		sample = std::make_shared<sample_type>();
-		sample->set_dimension(grid_number.size());
+		std::vector<std::vector<TIndex>> keys;
+		keys.reserve(in_sample.size());
 		for(size_t i = 0; i != in_sample.size(); ++i)
 		{
 			std::vector<TIndex> temp(in_sample[i].size());
@@ -110,80 +99,77 @@ namespace mveqf
 			{
 				temp[j] = get_the_closest_grid_node_to_the_value(lb[j], ub[j], grid_number[j], in_sample[i][j]);
 			}
-//			for(size_t j = 0; j != temp.size(); j++)
-//			{
-//				std::cout << temp[j] << ' ';
-//			}
-//			std::cout << std::endl;
-			sample->insert(temp);
+			keys.push_back(temp);
 		}
-		sample->fill_tree_count();
+		std::sort(keys.begin(), keys.end());
+		automaton().build(keys, std::vector<size_t>());
 	}
 
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample(const std::vector<std::vector<TFloat>> &in_sample, const std::vector<size_t> &weights)
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::set_sample(const std::vector<std::vector<TFloat>> &in_sample, const std::vector<size_t> &weights)
 	{
-		set_sample(in_sample);
-	}
-
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample)
-	{
-		sample = std::move(in_sample);
-		sample->fill_tree_count();
-	}
-
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample_shared(std::shared_ptr<sample_type> in_sample)
-	{
-		sample = std::move(in_sample);
-	}
-
-	template <typename TIndex, typename TFloat>
-	std::pair<size_t, size_t> ImplicitQuantileMFSA<TIndex, TFloat>::count_less(mfsa::Node<TIndex> *layer, const size_t &r) const
-	{
-		std::pair<size_t, size_t> res;
-		for(const auto &i : layer->children)
+		if(weights.size() != in_sample.size())
+			throw std::logic_error("weights.size() != in_sample.size()");
+		// points falling into the same cell add up their weights
+		std::vector<std::pair<std::vector<TIndex>, size_t>> cells;
+		cells.reserve(in_sample.size());
+		for(size_t i = 0; i != in_sample.size(); ++i)
 		{
-			size_t j = static_cast<size_t>(i.first);
-			if(j < r + 1)
+			if(weights[i] == 0)
+				continue;
+			std::vector<TIndex> temp(in_sample[i].size());
+			for(size_t j = 0; j != in_sample[i].size(); ++j)
 			{
-				res.second += i.second->count;
-				if(j < r)
-				{
-					res.first += i.second->count;
-				}
+				temp[j] = get_the_closest_grid_node_to_the_value(lb[j], ub[j], grid_number[j], in_sample[i][j]);
 			}
+			cells.emplace_back(std::move(temp), weights[i]);
 		}
-		return res;
+		std::sort(cells.begin(), cells.end());
+		std::vector<std::vector<TIndex>> keys;
+		std::vector<size_t> counts;
+		for(auto &i : cells)
+		{
+			if(!keys.empty() && keys.back() == i.first)
+				counts.back() += i.second;
+			else
+			{
+				keys.push_back(std::move(i.first));
+				counts.push_back(i.second);
+			}
+		}
+		automaton().build(keys, counts);
 	}
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const
+
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const
 	{
-		auto p = sample->root.get();
+		TState p = automaton().get_root();
 		for(size_t i = 0, k; i != in01.size(); ++i)
 		{
 			std::tie(k, out[i]) = quantile_transform(p, i, in01[i]);
-			p = p->children[k].second.get();
+			p = automaton().get_target(p, k);
 		}
 	}
-	template <typename TIndex, typename TFloat>
-	void ImplicitQuantileMFSA<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const
+
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	void ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const
 	{
-		auto p = sample->root.get();
+		TState p = automaton().get_root();
 		for(size_t i = 0; i != in01.size(); ++i)
 		{
 			//std::tie(k, out[i]) = quantile_transform(p, i, in01[i]);
 			auto [k, result] = quantile_transform(p, i, in01[i]);
-			out[i] = p->children[k].first;
-			p = p->children[k].second.get();
+			out[i] = automaton().get_label(p, k);
+			p = automaton().get_target(p, k);
 		}
 	}
-	template <typename TIndex, typename TFloat>
-	std::pair<size_t, TFloat> ImplicitQuantileMFSA<TIndex, TFloat>::quantile_transform(mveqf::mfsa::Node<TIndex> *layer, size_t ind, TFloat val01) const
+
+	template <typename TIndex, typename TFloat, typename TState, typename TAutomaton>
+	std::pair<size_t, TFloat> ImplicitQuantileAutomaton<TIndex, TFloat, TState, TAutomaton>::quantile_transform(TState layer, size_t ind, TFloat val01) const
 	{
+		const size_t size = automaton().get_size(layer);
 		size_t m = 0, count = grid_number[ind], step, a = 0, b = 0;
-		TFloat x = 0.0, y = 0.0, p = static_cast<TFloat>(layer->count);
+		TFloat x = 0.0, y = 0.0, p = static_cast<TFloat>(automaton().get_count(layer));
 		//auto first = grids[ind].begin();
 		//auto it = grids[ind].begin();
 		size_t it = 0, first = 0;
@@ -197,7 +183,7 @@ namespace mveqf
 			//std::advance(it, step);
 			//m = std::distance(grids[ind].begin(), it);
 
-			std::tie(a, b) = count_less(layer, m);
+			std::tie(a, b) = automaton().count_less(layer, m);
 			x = static_cast<TFloat>(a)/p;
 
 			if(x < val01)
@@ -218,36 +204,24 @@ namespace mveqf
 		}
 		if(a == b)
 		{
-			if(a == 0)
+			if(a == 0 || a == automaton().get_count(layer))
 			{
-				auto min_val_it = std::min_element(layer->children.begin(), layer->children.end(),
-				                                   [](const auto &l,
-				                                      const auto &r)
+				// the first or the last occupied cell
+				size_t index = 0;
+				for(size_t i = 1; i != size; ++i)
 				{
-					return l.first < r.first;
-				});
-				size_t min_ind = std::distance(layer->children.begin(), min_val_it);
-				//return std::make_pair(min_ind, grids[ind][layer->children[min_ind]->index] + 2.0*val01*dx[ind]);
-				return std::make_pair(min_ind, get_grid_value(ind, layer->children[min_ind].first) + 2.0*val01*dx[ind]);
-			}
-			if(a == layer->count)
-			{
-				auto max_val_it = std::max_element(layer->children.begin(), layer->children.end(),
-				                                   [](const auto &l,
-				                                      const auto &r)
-				{
-					return l.first < r.first;
-				});
-				size_t max_ind = std::distance(layer->children.begin(), max_val_it);
-				//return std::make_pair(max_ind, grids[ind][layer->children[max_ind]->index] + 2.0*val01*dx[ind]);
-				return std::make_pair(max_ind, get_grid_value(ind, layer->children[max_ind].first) + 2.0*val01*dx[ind]);
+					if(a == 0 ? automaton().get_label(layer, i) < automaton().get_label(layer, index) : automaton().get_label(layer, index) < automaton().get_label(layer, i))
+						index = i;
+				}
+				//return std::make_pair(index, grids[ind][layer->children[index]->index] + 2.0*val01*dx[ind]);
+				return std::make_pair(index, get_grid_value(ind, automaton().get_label(layer, index)) + 2.0*val01*dx[ind]);
 			}
 			int diff = std::numeric_limits<int>::max();
 			size_t index = 0;
-			int min_ind = static_cast<int>(layer->children[index].first);
-			for(size_t i = 1; i != layer->children.size(); ++i)
+			int min_ind = static_cast<int>(automaton().get_label(layer, index));
+			for(size_t i = 1; i != size; ++i)
 			{
-				int t = static_cast<int>(layer->children[i].first);
+				int t = static_cast<int>(automaton().get_label(layer, i));
 				int curr = std::abs(t - static_cast<int>(m));
 				if(diff > curr)
 				{
@@ -265,13 +239,13 @@ namespace mveqf
 				}
 			}
 			//return std::make_pair(index, grids[ind][layer->children[index]->index] + 2.0*val01*dx[ind]);
-			return std::make_pair(index, get_grid_value(ind, layer->children[index].first) + 2.0*val01*dx[ind]);
+			return std::make_pair(index, get_grid_value(ind, automaton().get_label(layer, index)) + 2.0*val01*dx[ind]);
 		}
 		size_t index = 0;
 		TIndex target = static_cast<TIndex>(m);
-		for(size_t j = 1; j < layer->children.size(); j++)
+		for(size_t j = 1; j < size; j++)
 		{
-			if(layer->children[j].first == target)
+			if(automaton().get_label(layer, j) == target)
 			{
 				index = j;
 				break;
@@ -280,6 +254,349 @@ namespace mveqf
 		//return std::make_pair(index, grids[ind][m] + (val01 - x) * (grids[ind][m + 1] - grids[ind][m]) / (y - x));
 		return std::make_pair(index, get_grid_value(ind, m) + (val01 - x) * (get_grid_value(ind, m + 1) - get_grid_value(ind, m)) / (y - x));
 	}
+
+	template <typename TIndex, typename TFloat>
+	class ImplicitQuantileMFSA : public ImplicitQuantileAutomaton<TIndex, TFloat, const mfsa::Node<TIndex>*, ImplicitQuantileMFSA<TIndex, TFloat>>
+	{
+	protected:
+		typedef mveqf::mfsa::MFSA<TIndex> sample_type;
+		typedef const mfsa::Node<TIndex>* state_type;
+		typedef ImplicitQuantileAutomaton<TIndex, TFloat, state_type, ImplicitQuantileMFSA<TIndex, TFloat>> base_type;
+		friend base_type;
+		std::shared_ptr<sample_type> sample;
+
+		using base_type::grid_number;
+
+		// states are shared by many prefixes, so sorted labels and prefix sums of
+		// the children counts are computed once per state
+		struct StateMass
+		{
+			std::vector<TIndex> labels;
+			std::vector<size_t> psum;
+		};
+		// built on the first transform after the sample or its counts change, the
+		// owner and revision of the automaton tell when the cache is out of date
+		mutable std::unordered_map<const mfsa::Node<TIndex>*, StateMass> mass;
+		mutable std::atomic<const sample_type*> mass_sample{nullptr};
+		mutable std::atomic<size_t> mass_revision{0};
+		mutable std::mutex mass_mutex;
+
+		void fill_mass_cache(const mfsa::Node<TIndex> *p) const;
+
+		state_type get_root() const;
+		size_t get_count(state_type layer) const;
+		size_t get_size(state_type layer) const;
+		TIndex get_label(state_type layer, size_t k) const;
+		state_type get_target(state_type layer, size_t k) const;
+		std::pair<size_t, size_t> count_less(state_type layer, const size_t &r) const;
+		void build(const std::vector<std::vector<TIndex>> &keys, const std::vector<size_t> &weights);
+	public:
+		ImplicitQuantileMFSA() = default;
+		ImplicitQuantileMFSA(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
+		ImplicitQuantileMFSA(const ImplicitQuantileMFSA&) = delete;
+		ImplicitQuantileMFSA& operator=(const ImplicitQuantileMFSA&) = delete;
+		void set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample);
+		void set_sample_shared(std::shared_ptr<sample_type> in_sample);
+		void fill_mass_cache() const;
+		void transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const override;
+		void transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const override;
+		size_t get_node_count() const;
+		size_t get_link_count() const;
+		~ImplicitQuantileMFSA();
+	};
+
+	template <typename TIndex, typename TFloat>
+	ImplicitQuantileMFSA<TIndex, TFloat>::ImplicitQuantileMFSA(std::vector<TFloat> in_lb,
+	    std::vector<TFloat> in_ub,
+	    std::vector<size_t> in_gridn) : base_type(in_lb, in_ub, in_gridn)
+	{}
+
+	template <typename TIndex, typename TFloat>
+	ImplicitQuantileMFSA<TIndex, TFloat>::~ImplicitQuantileMFSA()
+	{}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_node_count() const
+	{
+		return sample->get_node_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_link_count() const
+	{
+		return sample->get_link_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::build(const std::vector<std::vector<TIndex>> &keys, const std::vector<size_t> &weights)
+	{
+		mass_sample = nullptr;
+		sample = std::make_shared<sample_type>();
+		sample->set_dimension(grid_number.size());
+		if(weights.empty())
+			sample->insert_sorted(keys);
+		else
+		{
+			for(size_t i = 0; i != keys.size(); ++i)
+				sample->insert(keys[i], weights[i]);
+		}
+		sample->fill_tree_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample)
+	{
+		mass_sample = nullptr;
+		sample = std::move(in_sample);
+		sample->fill_tree_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::set_sample_shared(std::shared_ptr<sample_type> in_sample)
+	{
+		mass_sample = nullptr;
+		sample = std::move(in_sample);
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::fill_mass_cache() const
+	{
+		if(mass_sample.load() == sample.get() && mass_revision.load() == sample->get_revision())
+			return;
+		std::lock_guard<std::mutex> lock(mass_mutex);
+		if(mass_sample.load() == sample.get() && mass_revision.load() == sample->get_revision())
+			return;
+		mass_sample = nullptr;
+		mass.clear();
+		fill_mass_cache(sample->root.get());
+		mass_revision = sample->get_revision();
+		mass_sample = sample.get();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::fill_mass_cache(const mfsa::Node<TIndex> *p) const
+	{
+		if(p->children.empty() || !mass.emplace(p, StateMass()).second)
+			return;
+		std::vector<std::pair<TIndex, size_t>> t;
+		t.reserve(p->children.size());
+		for(const auto &i : p->children)
+			t.emplace_back(i.first, i.second->count);
+		std::sort(t.begin(), t.end());
+		StateMass &m = mass[p];
+		m.labels.resize(t.size());
+		m.psum.resize(t.size() + 1);
+		for(size_t i = 0; i != t.size(); i++)
+		{
+			m.labels[i] = t[i].first;
+			m.psum[i + 1] = m.psum[i] + t[i].second;
+		}
+		for(const auto &i : p->children)
+			fill_mass_cache(i.second.get());
+	}
+
+	template <typename TIndex, typename TFloat>
+	typename ImplicitQuantileMFSA<TIndex, TFloat>::state_type ImplicitQuantileMFSA<TIndex, TFloat>::get_root() const
+	{
+		return sample->root.get();
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_count(state_type layer) const
+	{
+		return layer->count;
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileMFSA<TIndex, TFloat>::get_size(state_type layer) const
+	{
+		return layer->children.size();
+	}
+
+	template <typename TIndex, typename TFloat>
+	TIndex ImplicitQuantileMFSA<TIndex, TFloat>::get_label(state_type layer, size_t k) const
+	{
+		return layer->children[k].first;
+	}
+
+	template <typename TIndex, typename TFloat>
+	typename ImplicitQuantileMFSA<TIndex, TFloat>::state_type ImplicitQuantileMFSA<TIndex, TFloat>::get_target(state_type layer, size_t k) const
+	{
+		return layer->children[k].second.get();
+	}
+
+	template <typename TIndex, typename TFloat>
+	std::pair<size_t, size_t> ImplicitQuantileMFSA<TIndex, TFloat>::count_less(state_type layer, const size_t &r) const
+	{
+		auto it = mass.find(layer);
+		if(it != mass.end())
+		{
+			const auto &labels = it->second.labels;
+			auto first = std::lower_bound(labels.begin(), labels.end(), r, [](const TIndex &l, size_t v)
+			{
+				return static_cast<size_t>(l) < v;
+			});
+			auto last = std::lower_bound(first, labels.end(), r + 1, [](const TIndex &l, size_t v)
+			{
+				return static_cast<size_t>(l) < v;
+			});
+			return std::make_pair(it->second.psum[std::distance(labels.begin(), first)], it->second.psum[std::distance(labels.begin(), last)]);
+		}
+		std::pair<size_t, size_t> res;
+		for(const auto &i : layer->children)
+		{
+			size_t j = static_cast<size_t>(i.first);
+			if(j < r + 1)
+			{
+				res.second += i.second->count;
+				if(j < r)
+				{
+					res.first += i.second->count;
+				}
+			}
+		}
+		return res;
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TFloat>& out) const
+	{
+		fill_mass_cache();
+		base_type::transform(in01, out);
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileMFSA<TIndex, TFloat>::transform(const std::vector<TFloat>& in01, std::vector<TIndex>& out) const
+	{
+		fill_mass_cache();
+		base_type::transform(in01, out);
+	}
+
+	template <typename TIndex, typename TFloat>
+	class ImplicitQuantileArenaMFSA : public ImplicitQuantileAutomaton<TIndex, TFloat, typename mfsa::ArenaMFSA<TIndex>::state_id, ImplicitQuantileArenaMFSA<TIndex, TFloat>>
+	{
+	protected:
+		typedef mveqf::mfsa::ArenaMFSA<TIndex> sample_type;
+		typedef typename sample_type::state_id state_id;
+		typedef ImplicitQuantileAutomaton<TIndex, TFloat, state_id, ImplicitQuantileArenaMFSA<TIndex, TFloat>> base_type;
+		friend base_type;
+		std::shared_ptr<sample_type> sample;
+
+		using base_type::grid_number;
+
+		state_id get_root() const;
+		size_t get_count(state_id layer) const;
+		size_t get_size(state_id layer) const;
+		TIndex get_label(state_id layer, size_t k) const;
+		state_id get_target(state_id layer, size_t k) const;
+		std::pair<size_t, size_t> count_less(state_id layer, const size_t &r) const;
+		void build(const std::vector<std::vector<TIndex>> &keys, const std::vector<size_t> &weights);
+	public:
+		ImplicitQuantileArenaMFSA() = default;
+		ImplicitQuantileArenaMFSA(std::vector<TFloat> in_lb, std::vector<TFloat> in_ub, std::vector<size_t> in_gridn);
+		ImplicitQuantileArenaMFSA(const ImplicitQuantileArenaMFSA&) = delete;
+		ImplicitQuantileArenaMFSA& operator=(const ImplicitQuantileArenaMFSA&) = delete;
+		void set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample);
+		void set_sample_shared(std::shared_ptr<sample_type> in_sample);
+		size_t get_node_count() const;
+		size_t get_link_count() const;
+		~ImplicitQuantileArenaMFSA();
+	};
+
+	template <typename TIndex, typename TFloat>
+	ImplicitQuantileArenaMFSA<TIndex, TFloat>::ImplicitQuantileArenaMFSA(std::vector<TFloat> in_lb,
+	    std::vector<TFloat> in_ub,
+	    std::vector<size_t> in_gridn) : base_type(in_lb, in_ub, in_gridn)
+	{}
+
+	template <typename TIndex, typename TFloat>
+	ImplicitQuantileArenaMFSA<TIndex, TFloat>::~ImplicitQuantileArenaMFSA()
+	{}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_node_count() const
+	{
+		return sample->get_node_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_link_count() const
+	{
+		return sample->get_link_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileArenaMFSA<TIndex, TFloat>::build(const std::vector<std::vector<TIndex>> &keys, const std::vector<size_t> &weights)
+	{
+		sample = std::make_shared<sample_type>();
+		sample->set_dimension(grid_number.size());
+		for(size_t i = 0; i != keys.size(); ++i)
+		{
+			if(weights.empty())
+				sample->insert(keys[i]);
+			else
+				sample->insert(keys[i], weights[i]);
+		}
+		sample->fill_tree_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileArenaMFSA<TIndex, TFloat>::set_sample_shared_and_fill_count(std::shared_ptr<sample_type> in_sample)
+	{
+		sample = std::move(in_sample);
+		sample->fill_tree_count();
+	}
+
+	template <typename TIndex, typename TFloat>
+	void ImplicitQuantileArenaMFSA<TIndex, TFloat>::set_sample_shared(std::shared_ptr<sample_type> in_sample)
+	{
+		sample = std::move(in_sample);
+	}
+
+	template <typename TIndex, typename TFloat>
+	typename ImplicitQuantileArenaMFSA<TIndex, TFloat>::state_id ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_root() const
+	{
+		return sample->get_root();
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_count(state_id layer) const
+	{
+		return sample->get_state(layer).count;
+	}
+
+	template <typename TIndex, typename TFloat>
+	size_t ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_size(state_id layer) const
+	{
+		return sample->get_state(layer).size;
+	}
+
+	template <typename TIndex, typename TFloat>
+	TIndex ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_label(state_id layer, size_t k) const
+	{
+		return sample->get_edge(layer, k).label;
+	}
+
+	template <typename TIndex, typename TFloat>
+	typename ImplicitQuantileArenaMFSA<TIndex, TFloat>::state_id ImplicitQuantileArenaMFSA<TIndex, TFloat>::get_target(state_id layer, size_t k) const
+	{
+		return sample->get_edge(layer, k).target;
+	}
+
+	template <typename TIndex, typename TFloat>
+	std::pair<size_t, size_t> ImplicitQuantileArenaMFSA<TIndex, TFloat>::count_less(state_id layer, const size_t &r) const
+	{
+		// the edges of a state are sorted by label
+		const auto first = sample->get_edges(layer);
+		const auto last = first + sample->get_state(layer).size;
+		auto less = [](const typename sample_type::Edge &e, size_t v)
+		{
+			return static_cast<size_t>(e.label) < v;
+		};
+		auto a = std::lower_bound(first, last, r, less);
+		auto b = std::lower_bound(a, last, r + 1, less);
+		return std::make_pair(sample->get_mass(layer, a - first), sample->get_mass(layer, b - first));
+	}
 }
 
 #endif
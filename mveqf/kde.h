@@ -20,11 +20,16 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <limits>
 #include <numeric>
 #include <future>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <mveqf/thread_pool.h>
 
 namespace mveqf
 {
@@ -32,15 +37,42 @@ namespace mveqf
 	namespace kde
 	{
 
-		template <typename T>
-		class Kernels
+		class CellHasher
 		{
-		protected:
-			const T pi = std::acos(-1.0);
 		public:
-			Kernels() {}
-		protected:
-			inline T gaussian_cdf(T x, T mu, T sigma) const
+			size_t operator()(const std::vector<size_t>& key) const
+			{
+				std::size_t seed = key.size();
+				for(auto& i : key)
+				{
+					seed ^= i + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+				}
+				return seed;
+			}
+		};
+
+		// Kernel functors. pdf(x) = norm(sigma, lambda)*shape(z, lambda) with
+		// z = (x - mu)/sigma, exponential kernels provide exponent(z, lambda) instead
+		// of shape so that a product kernel needs a single exp per sample.
+		template <typename T>
+		struct GaussianKernel
+		{
+			static constexpr bool exponential = true;
+			static constexpr T sqrt_2pi = 2.50662827463100050242;
+			static inline T norm(T sigma, T lambda)
+			{
+				return 1.0/(sigma*sqrt_2pi);
+			}
+			static inline T exponent(T z, T lambda)
+			{
+				return -0.5*z*z;
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
+			{
+				T z = (x - mu)/sigma;
+				return std::exp(-0.5*z*z)/(sigma*sqrt_2pi);
+			}
+			static inline T cdf(T x, T mu, T sigma, T lambda)
 			{
 				// 0.5*(1.0 + std::erf((x - mu)/(sigma*std::sqrt(2.0))))
 				// Abramowitz Stegun normal CDF
@@ -48,88 +80,411 @@ namespace mveqf
 				T y = t*(0.319381530 + t*(-0.356563782 + t*(1.781477937 + t*(-1.821255978 + t*1.330274429))));
 				if(x >= mu)
 				{
-					return 1.0 - gaussian_pdf(x, mu, sigma)*y*sigma;
+					return 1.0 - pdf(x, mu, sigma, lambda)*y*sigma;
 				}
 				else
 				{
-					return gaussian_pdf(x, mu, sigma)*y*sigma;
+					return pdf(x, mu, sigma, lambda)*y*sigma;
 				}
 			}
-			inline T epanechnikov_cdf(T x, T mu, T sigma) const
+		};
+
+		template <typename T>
+		struct LaplacianKernel
+		{
+			static constexpr bool exponential = true;
+			static inline T norm(T sigma, T lambda)
+			{
+				return 0.5*lambda;
+			}
+			static inline T exponent(T z, T lambda)
+			{
+				return -std::abs(lambda*z);
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
 			{
 				T z = (x - mu)/sigma;
-				if(z < -1.0)
-					return 0.0;
-				if(z >  1.0)
-					return 1.0;
-				return 0.25*(2.0 + 3.0*z - std::pow(z, 3.0));
+				return 0.5*lambda*std::exp(-std::abs(lambda*z));
 			}
-			inline T laplacian_cdf(T x, T mu, T sigma, T lambda) const
+			static inline T cdf(T x, T mu, T sigma, T lambda)
 			{
 				T z = (x - mu)/sigma;
 				if(z < 0.0)
 					return 0.5*std::exp(lambda*z);
 				return 1.0 - 0.5 *std::exp(-lambda*z);
 			}
-			inline T biweight_cdf(T x, T mu, T sigma) const
+		};
+
+		template <typename T>
+		struct EpanechnikovKernel
+		{
+			static constexpr bool exponential = false;
+			static inline T norm(T sigma, T lambda)
+			{
+				return 0.75/sigma;
+			}
+			static inline T shape(T z, T lambda)
+			{
+				T t = 1.0 - z*z;
+				return t > 0.0 ? t : 0.0;
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
+			{
+				T z = (x - mu)/sigma;
+				return std::abs(z) > 1.0 ? 0.0 : 0.75*(1.0 - z*z)/sigma;
+			}
+			static inline T cdf(T x, T mu, T sigma, T lambda)
 			{
 				T z = (x - mu)/sigma;
 				if(z < -1.0)
 					return 0.0;
 				if(z >  1.0)
 					return 1.0;
-				return 0.9375*(z -  2.0*std::pow(z, 3.0)/3.0 + 0.2*std::pow(z, 5.0)) + 0.5;
+				return 0.25*(2.0 + 3.0*z - z*z*z);
 			}
-			inline T triweight_cdf(T x, T mu, T sigma) const
+		};
+
+		template <typename T>
+		struct UniformKernel
+		{
+			static constexpr bool exponential = false;
+			static inline T norm(T sigma, T lambda)
+			{
+				return 1.0/sigma;
+			}
+			static inline T shape(T z, T lambda)
+			{
+				return std::abs(z) > 0.5 ? 0.0 : 1.0;
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
+			{
+				return (x < mu - 0.5*sigma || x > mu + 0.5*sigma) ? 0.0 : 1.0/sigma;
+			}
+			static inline T cdf(T x, T mu, T sigma, T lambda)
+			{
+				if(x < mu - 0.5*sigma)
+					return 0.0;
+				if(x > mu + 0.5*sigma)
+					return 1.0;
+				return (x-mu)/sigma + 0.5;
+			}
+		};
+
+		template <typename T>
+		struct BiweightKernel
+		{
+			static constexpr bool exponential = false;
+			static inline T norm(T sigma, T lambda)
+			{
+				return 0.9375;
+			}
+			static inline T shape(T z, T lambda)
+			{
+				T t = 1.0 - z*z;
+				return t > 0.0 ? t*t : 0.0;
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
+			{
+				T z = (x - mu)/sigma;
+				T t = 1.0 - z*z;
+				return std::abs(z) > 1.0 ? 0.0 : 0.9375*t*t;
+			}
+			static inline T cdf(T x, T mu, T sigma, T lambda)
 			{
 				T z = (x - mu)/sigma;
 				if(z < -1.0)
 					return 0.0;
 				if(z >  1.0)
 					return 1.0;
-				return 1.09375*(z - std::pow(z, 3.0) + 0.6*std::pow(z, 5.0) - std::pow(z, 7.0)/7.0) + 0.5;
+				T z2 = z*z;
+				return 0.9375*z*(1.0 - z2*(2.0/3.0 - 0.2*z2)) + 0.5;
 			}
-			inline T uniform_cdf(T x, T mu, T sigma) const
+		};
+
+		template <typename T>
+		struct TriweightKernel
+		{
+			static constexpr bool exponential = false;
+			static inline T norm(T sigma, T lambda)
 			{
-				if(x < mu - 0.5*sigma)
+				return 1.09375;
+			}
+			static inline T shape(T z, T lambda)
+			{
+				T t = 1.0 - z*z;
+				return t > 0.0 ? t*t*t : 0.0;
+			}
+			static inline T pdf(T x, T mu, T sigma, T lambda)
+			{
+				T z = (x - mu)/sigma;
+				T t = 1.0 - z*z;
+				return std::abs(z) > 1.0 ? 0.0 : 1.09375*t*t*t;
+			}
+			static inline T cdf(T x, T mu, T sigma, T lambda)
+			{
+				T z = (x - mu)/sigma;
+				if(z < -1.0)
 					return 0.0;
-				if(x > mu + 0.5*sigma)
+				if(z >  1.0)
 					return 1.0;
-				return (x-mu)/sigma + 0.5;
+				T z2 = z*z;
+				return 1.09375*z*(1.0 - z2*(1.0 - z2*(0.6 - z2/7.0))) + 0.5;
 			}
-			inline T gaussian_pdf(T x, T mu, T sigma) const
+		};
+
+		// Kernel pdf and cdf tabulated over the standardised argument u = z (u = lambda*z
+		// for the laplacian) and interpolated linearly (1) or by cubic Hermite
+		// polynomials (2); arguments outside the table are evaluated exactly.
+		template <typename T>
+		class KernelTable
+		{
+		public:
+			KernelTable(size_t kt, size_t interp = 1, size_t n = 4096);
+			size_t get_kernel_type() const;
+			T pdf(T x, T mu, T sigma, T lambda) const;
+			T cdf(T x, T mu, T sigma, T lambda) const;
+
+			static T exact_pdf(size_t kt, T x, T mu, T sigma, T lambda);
+			static T exact_cdf(size_t kt, T x, T mu, T sigma, T lambda);
+			static T exact_slope(size_t kt, T u, bool right);
+		protected:
+			size_t kernel_type;
+			size_t interpolation;
+			T reach, step, inv_step;
+			// pdf slopes are one-sided so that kinks on the nodes are kept
+			std::vector<T> pdf_value, pdf_left, pdf_right;
+			std::vector<T> cdf_value, cdf_slope;
+
+			T get_argument(T x, T mu, T sigma, T lambda) const;
+			T lookup(const std::vector<T> &value, const std::vector<T> &right, const std::vector<T> &left, T u) const;
+		};
+
+		template <typename T>
+		KernelTable<T>::KernelTable(size_t kt, size_t interp, size_t n) : kernel_type(kt), interpolation(interp)
+		{
+			if(n < 2)
+				throw std::logic_error("kernel table size");
+			switch(kernel_type)
+			{
+				case 1:
+				case 3:
+				case 4:
+					reach = 1.0;
+					break;
+				case 2:
+					reach = 0.5;
+					break;
+				case 5:
+					reach = 20.0;
+					break;
+				default:
+					reach = 8.0;
+			}
+			step = 2.0*reach/n;
+			inv_step = 1.0/step;
+			pdf_value.resize(n + 1);
+			pdf_left.resize(n + 1);
+			pdf_right.resize(n + 1);
+			cdf_value.resize(n + 1);
+			cdf_slope.resize(n + 1);
+			for(size_t i = 0; i <= n; i++)
+			{
+				const T u = i == n ? reach : -reach + i*step;
+				pdf_value[i] = exact_pdf(kernel_type, u, 0.0, 1.0, 1.0);
+				cdf_value[i] = exact_cdf(kernel_type, u, 0.0, 1.0, 1.0);
+				cdf_slope[i] = pdf_value[i];
+				pdf_right[i] = exact_slope(kernel_type, u, true);
+				pdf_left[i] = exact_slope(kernel_type, u, false);
+			}
+		}
+
+		template <typename T>
+		size_t KernelTable<T>::get_kernel_type() const
+		{
+			return kernel_type;
+		}
+
+		template <typename T>
+		T KernelTable<T>::get_argument(T x, T mu, T sigma, T lambda) const
+		{
+			T z = (x - mu)/sigma;
+			return kernel_type == 5 ? lambda*z : z;
+		}
+
+		template <typename T>
+		T KernelTable<T>::lookup(const std::vector<T> &value, const std::vector<T> &right, const std::vector<T> &left, T u) const
+		{
+			const T t = (u + reach)*inv_step;
+			const size_t i = std::min(static_cast<size_t>(t), value.size() - 2);
+			const T f = t - i;
+			if(interpolation != 2)
+				return value[i] + f*(value[i + 1] - value[i]);
+			const T f2 = f*f, f3 = f2*f;
+			return (2.0*f3 - 3.0*f2 + 1.0)*value[i] + (f3 - 2.0*f2 + f)*step*right[i]
+			       + (3.0*f2 - 2.0*f3)*value[i + 1] + (f3 - f2)*step*left[i + 1];
+		}
+
+		template <typename T>
+		T KernelTable<T>::pdf(T x, T mu, T sigma, T lambda) const
+		{
+			const T u = get_argument(x, mu, sigma, lambda);
+			if(!(std::abs(u) < reach))
+				return exact_pdf(kernel_type, x, mu, sigma, lambda);
+			const T v = lookup(pdf_value, pdf_right, pdf_left, u);
+			switch(kernel_type)
+			{
+				case 3:
+				case 4:
+					return v;
+				case 5:
+					return lambda*v;
+				default:
+					return v/sigma;
+			}
+		}
+
+		template <typename T>
+		T KernelTable<T>::cdf(T x, T mu, T sigma, T lambda) const
+		{
+			const T u = get_argument(x, mu, sigma, lambda);
+			if(!(std::abs(u) < reach))
+				return exact_cdf(kernel_type, x, mu, sigma, lambda);
+			return lookup(cdf_value, cdf_slope, cdf_slope, u);
+		}
+
+		template <typename T>
+		T KernelTable<T>::exact_pdf(size_t kt, T x, T mu, T sigma, T lambda)
+		{
+			switch(kt)
+			{
+				case 1:
+					return EpanechnikovKernel<T>::pdf(x, mu, sigma, lambda);
+				case 2:
+					return UniformKernel<T>::pdf(x, mu, sigma, lambda);
+				case 3:
+					return BiweightKernel<T>::pdf(x, mu, sigma, lambda);
+				case 4:
+					return TriweightKernel<T>::pdf(x, mu, sigma, lambda);
+				case 5:
+					return LaplacianKernel<T>::pdf(x, mu, sigma, lambda);
+				default:
+					return GaussianKernel<T>::pdf(x, mu, sigma, lambda);
+			}
+		}
+
+		// derivative of the standardised pdf at u, taken from the right or the left
+		// where the kernel has a kink
+		template <typename T>
+		T KernelTable<T>::exact_slope(size_t kt, T u, bool right)
+		{
+			const T t = 1 - u*u;
+			if(kt >= 1 && kt <= 4 && (t < 0 || (t == 0 && (u > 0) == right)))
+				return 0;
+			switch(kt)
+			{
+				case 1:
+					return T(-1.5)*u;
+				case 2:
+					return 0;
+				case 3:
+					return T(-3.75)*u*t;
+				case 4:
+					return T(-6.5625)*u*t*t;
+				case 5:
+					return (u > 0 || (u == 0 && right) ? T(-0.5) : T(0.5))*std::exp(-std::abs(u));
+				default:
+					return -u*GaussianKernel<T>::pdf(u, 0, 1, 1);
+			}
+		}
+
+		template <typename T>
+		T KernelTable<T>::exact_cdf(size_t kt, T x, T mu, T sigma, T lambda)
+		{
+			switch(kt)
 			{
-				return std::exp(-0.5*std::pow((x - mu)/sigma, 2.0))/(sigma*std::sqrt(2.0*pi));
+				case 1:
+					return EpanechnikovKernel<T>::cdf(x, mu, sigma, lambda);
+				case 2:
+					return UniformKernel<T>::cdf(x, mu, sigma, lambda);
+				case 3:
+					return BiweightKernel<T>::cdf(x, mu, sigma, lambda);
+				case 4:
+					return TriweightKernel<T>::cdf(x, mu, sigma, lambda);
+				case 5:
+					return LaplacianKernel<T>::cdf(x, mu, sigma, lambda);
+				default:
+					return GaussianKernel<T>::cdf(x, mu, sigma, lambda);
+			}
+		}
 
-//        return fmath::exp(-0.5*std::pow((x - mu)/sigma, 2.0))/(sigma*std::sqrt(2.0*pi));
+		template <typename T>
+		class Kernels
+		{
+		protected:
+			const T pi = std::acos(-1.0);
+			std::shared_ptr<const KernelTable<T>> table;
+		public:
+			Kernels() {}
+			// compute_pdf and compute_cdf of the table's kernel type go through the
+			// table, nullptr restores the exact evaluation
+			void set_kernel_table(std::shared_ptr<const KernelTable<T>> in_table)
+			{
+				table = std::move(in_table);
+			}
+		protected:
+			inline T gaussian_cdf(T x, T mu, T sigma) const
+			{
+				return GaussianKernel<T>::cdf(x, mu, sigma, 1.0);
+			}
+			inline T epanechnikov_cdf(T x, T mu, T sigma) const
+			{
+				return EpanechnikovKernel<T>::cdf(x, mu, sigma, 1.0);
+			}
+			inline T laplacian_cdf(T x, T mu, T sigma, T lambda) const
+			{
+				return LaplacianKernel<T>::cdf(x, mu, sigma, lambda);
+			}
+			inline T biweight_cdf(T x, T mu, T sigma) const
+			{
+				return BiweightKernel<T>::cdf(x, mu, sigma, 1.0);
+			}
+			inline T triweight_cdf(T x, T mu, T sigma) const
+			{
+				return TriweightKernel<T>::cdf(x, mu, sigma, 1.0);
+			}
+			inline T uniform_cdf(T x, T mu, T sigma) const
+			{
+				return UniformKernel<T>::cdf(x, mu, sigma, 1.0);
+			}
+			inline T gaussian_pdf(T x, T mu, T sigma) const
+			{
+				return GaussianKernel<T>::pdf(x, mu, sigma, 1.0);
 			}
 			inline T laplacian_pdf(T x, T mu, T sigma, T lambda) const
 			{
-				T z = (x - mu)/sigma;
-				return 0.5*lambda*std::exp(-std::abs(lambda*z));
+				return LaplacianKernel<T>::pdf(x, mu, sigma, lambda);
 			}
 			inline T epanechnikov_pdf(T x, T mu, T sigma) const
 			{
-				T z = (x - mu)/sigma;
-				return std::abs(z) > 1.0 ? 0.0 : 0.75*(1.0-std::pow(z, 2.0))/sigma;
+				return EpanechnikovKernel<T>::pdf(x, mu, sigma, 1.0);
 			}
 			inline T biweight_pdf(T x, T mu, T sigma) const
 			{
-				T z = (x - mu)/sigma;
-				return std::abs(z) > 1.0 ? 0.0 : 0.9375*std::pow(1.0 - std::pow(z, 2.0), 2.0);
+				return BiweightKernel<T>::pdf(x, mu, sigma, 1.0);
 			}
 			inline T triweight_pdf(T x, T mu, T sigma) const
 			{
-				T z = (x - mu)/sigma;
-				return std::abs(z) > 1.0 ? 0.0 : 1.09375*std::pow(1.0 - std::pow(z, 2.0), 3.0);
+				return TriweightKernel<T>::pdf(x, mu, sigma, 1.0);
 			}
 			inline T uniform_pdf(T x, T mu, T sigma) const
 			{
-				return (x < mu - 0.5*sigma || x > mu + 0.5*sigma) ? 0.0 : 1.0/sigma;
+				return UniformKernel<T>::pdf(x, mu, sigma, 1.0);
 			}
 		public:
 			inline T compute_pdf(size_t kt, T x, T mu, T sigma, T lambda = 1.0) const
 			{
+				if(table && table->get_kernel_type() == kt)
+					return table->pdf(x, mu, sigma, lambda);
 				switch(kt)
 				{
 					case 1:
@@ -148,6 +503,8 @@ namespace mveqf
 			}
 			inline T compute_cdf(size_t kt, T x, T mu, T sigma, T lambda = 1.0) const
 			{
+				if(table && table->get_kernel_type() == kt)
+					return table->cdf(x, mu, sigma, lambda);
 				switch(kt)
 				{
 					case 1:
@@ -174,8 +531,15 @@ namespace mveqf
 			using kde::Kernels<T>::compute_cdf;
 
 			typedef std::vector<std::vector<T>> sample_type;
+			typedef typename sample_type::const_iterator sample_iterator;
+			typedef T (KDE<T>::*kernel_sum_type)(sample_iterator, sample_iterator, const size_t *, const std::vector<T> &, T) const;
+			typedef void (KDE<T>::*kernel_tile_type)(const T *, size_t, T *, T) const;
+			typedef T (KDE<T>::*kernel_pruned_type)(const std::vector<T> &, T) const;
 		public:
-			KDE() {}
+			KDE() : bandwidth_type(0), interpolation(0)
+			{
+				set_kernel_type(0);
+			}
 			KDE(const KDE&) = delete;
 			KDE& operator=(const KDE&) = delete;
 
@@ -185,6 +549,53 @@ namespace mveqf
 				kernel_type = kt;
 //        else
 //            throw std::logic_error("kernel type");
+				switch(kernel_type)
+				{
+					case 1:
+						use_kernel<EpanechnikovKernel<T>>();
+						break;
+					case 2:
+						use_kernel<UniformKernel<T>>();
+						break;
+					case 3:
+						use_kernel<BiweightKernel<T>>();
+						break;
+					case 4:
+						use_kernel<TriweightKernel<T>>();
+						break;
+					case 5:
+						use_kernel<LaplacianKernel<T>>();
+						break;
+					default:
+						use_kernel<GaussianKernel<T>>();
+				}
+				set_interpolation(interpolation);
+				if(sample)
+					build_support_index();
+			}
+			// 0 - exact kernels, 1 - linear, 2 - cubic interpolation of a kernel table,
+			// used by everything that goes through compute_pdf and compute_cdf: cdf,
+			// the cross-validated bandwidth and the pdf of TreeKDE and BinnedKDE.
+			// KDE::pdf and pdf_many sum the exact kernel functors
+			void set_interpolation(size_t it)
+			{
+				interpolation = it;
+				if(interpolation == 0)
+					this->set_kernel_table(nullptr);
+				else
+					this->set_kernel_table(std::make_shared<const KernelTable<T>>(kernel_type, interpolation));
+			}
+			// 0 - rule of thumb, 1 - least-squares cross-validation,
+			// 2 - likelihood cross-validation
+			void set_bandwidth_type(size_t bt)
+			{
+				bandwidth_type = bt;
+				if(sample)
+				{
+					calculate_bandwidth();
+					reset_flat_sample();
+					build_support_index();
+				}
 			}
 			void set_dimension(size_t dim)
 			{
@@ -220,6 +631,8 @@ namespace mveqf
 
 				count = sample->size();
 				calculate_bandwidth();
+				reset_flat_sample();
+				build_support_index();
 //        for(size_t j = 0; j != dimension; j++)
 //        {
 //            std::cout << j << std::endl;
@@ -248,28 +661,22 @@ namespace mveqf
 					count += *k;
 				}
 				calculate_bandwidth();
+				reset_flat_sample();
+				build_support_index();
 			}
 			T pdf(const std::vector<T> &x, const T lambda = 1.0) const
 			{
+				if(!support_order.empty())
+					return (this->*kernel_pruned)(x, lambda);
 				if(repeat_number->empty())
 				{
 					if(sample->size() < 1000000)
 					{
-						T res = 0.0;
-						for(auto it = sample->begin(); it != sample->end(); ++it)
-						{
-							T t = 1.0;
-							for(size_t i = 0; i != dimension; i++)
-							{
-								t *= compute_pdf(kernel_type, x[i], (*it)[i], bandwidth[i], lambda);
-							}
-							res += t;
-						}
-						return res/count;
+						return (this->*kernel_sum)(sample->cbegin(), sample->cend(), nullptr, x, lambda)/count;
 					}
 					else
 					{
-						return parallel_pdf(sample->begin(), sample->end(), x, lambda);
+						return parallel_pdf(sample->cbegin(), sample->cend(), nullptr, x, lambda);
 					}
 				}
 				else
@@ -277,96 +684,332 @@ namespace mveqf
 					if(repeat_number->size() != sample->size())
 						throw std::logic_error("times != sample");
 
-					T res = 0.0;
-					auto k = repeat_number->begin();
-					for(auto it = sample->begin(); it != sample->end(); ++it, ++k)
-					{
-						T t = 1.0;
-						for(size_t i = 0; i != dimension; i++)
-						{
-							t *= compute_pdf(kernel_type, x[i], (*it)[i], bandwidth[i], lambda);
-						}
-						res += (*k)*t;
-					}
-					return res/count;
+					if(sample->size() < 1000000)
+						return (this->*kernel_sum)(sample->cbegin(), sample->cend(), repeat_number->data(), x, lambda)/count;
+					return parallel_pdf(sample->cbegin(), sample->cend(), repeat_number->data(), x, lambda);
 				}
 			}
-			T cdf(const std::vector<T> &x, const T lambda = 1.0) const
+			// pdf of many queries at once, the (query x sample) tiles are spread over
+			// the injected pool; without a pool the queries are evaluated in turn
+			std::vector<T> pdf_batch(const std::vector<std::vector<T>> &queries, const T lambda = 1.0) const
 			{
-				if(sample->size() < 1000000)
+				const size_t *weight = nullptr;
+				if(!repeat_number->empty())
 				{
-					T res = 0.0;
-					for(auto it = sample->begin(); it != sample->end(); ++it)
+					if(repeat_number->size() != sample->size())
+						throw std::logic_error("times != sample");
+					weight = repeat_number->data();
+				}
+				std::vector<T> res(queries.size(), 0.0);
+				if(!pool)
+				{
+					for(size_t i = 0; i != queries.size(); i++)
+						res[i] = (this->*kernel_sum)(sample->cbegin(), sample->cend(), weight, queries[i], lambda)/count;
+					return res;
+				}
+
+				const size_t query_block = 16;
+				const size_t sample_block = std::max<size_t>(4096, sample->size()/(4*pool->size()) + 1);
+				std::vector<std::future<std::vector<T>>> futures;
+				std::vector<size_t> offsets;
+				for(size_t q = 0; q < queries.size(); q += query_block)
+				{
+					const size_t q_last = std::min(queries.size(), q + query_block);
+					for(size_t k = 0; k < sample->size(); k += sample_block)
 					{
-						T t = 1.0;
-						for(size_t j = 0; j != (*it).size(); j++)
+						const size_t k_last = std::min(sample->size(), k + sample_block);
+						offsets.push_back(q);
+						futures.emplace_back(pool->submit([this, &queries, q, q_last, k, k_last, weight, lambda]()
 						{
-							t *= compute_cdf(kernel_type, x[j], (*it)[j], bandwidth[j], lambda);
-						}
-						res += t;
+							std::vector<T> partial(q_last - q);
+							for(size_t i = q; i != q_last; i++)
+								partial[i - q] = (this->*kernel_sum)(sample->cbegin() + k, sample->cbegin() + k_last, weight ? weight + k : nullptr, queries[i], lambda);
+							return partial;
+						}));
 					}
-					return res/count;
 				}
-				else
+				for(size_t i = 0; i != futures.size(); i++)
 				{
-					return parallel_cdf(sample->begin(), sample->end(), x, lambda);
+					auto partial = futures[i].get();
+					for(size_t j = 0; j != partial.size(); j++)
+						res[offsets[i] + j] += partial[j];
 				}
+				for(auto &i : res)
+					i /= count;
+				return res;
 			}
-			std::vector<T> get_bandwidth() const
-			{
-				return bandwidth;
-			}
-		protected:
-			template<typename InputIt>
-			T pdf_it(InputIt first, InputIt last, const std::vector<T> &x, T lambda) const
+			// pdf of m queries stored row-major in queries[m*dimension], written to
+			// out[m]; the columnar sample is walked in blocks that stay in cache
+			// while a tile of queries is evaluated against them
+			void pdf_many(const T *queries, size_t m, T *out, const T lambda = 1.0) const
 			{
-				T res = 0.0;
-				for(auto it = first; it != last; ++it)
+				if(!support_order.empty())
 				{
-					T t = 1.0;
-					for(size_t i = 0; i != dimension; i++)
+					std::vector<T> x(dimension);
+					for(size_t i = 0; i != m; i++)
 					{
-						t *= compute_pdf(kernel_type, x[i], (*it)[i], bandwidth[i], lambda);
+						std::copy(queries + i*dimension, queries + (i + 1)*dimension, x.begin());
+						out[i] = (this->*kernel_pruned)(x, lambda);
 					}
-					res += t;
+					return;
 				}
-				return res;
-			}
-			template<typename InputIt>
-			T cdf(InputIt first, InputIt last, const std::vector<T> &x, T lambda) const
-			{
-				T res = 0.0;
-				for(auto it = first; it != last; ++it)
+				if(!repeat_number->empty() && repeat_number->size() != sample->size())
+					throw std::logic_error("times != sample");
+				build_flat_sample();
+
+				const size_t query_block = 32;
+				if(!pool || m <= query_block)
 				{
-					T t = 1.0;
-					for(size_t i = 0; i != dimension; i++)
+					(this->*kernel_tile)(queries, m, out, lambda);
+					return;
+				}
+				std::vector<std::future<void>> futures;
+				for(size_t q = 0; q < m; q += query_block)
+				{
+					const size_t n = std::min(query_block, m - q);
+					futures.emplace_back(pool->submit([this, queries, out, q, n, lambda]()
 					{
-						t *= compute_cdf(kernel_type, x[i], (*it)[i], bandwidth[i], lambda);
-					}
-					res += t;
+						(this->*kernel_tile)(queries + q*dimension, n, out + q, lambda);
+					}));
 				}
-				return res;
+				for(auto &i : futures)
+					i.get();
 			}
-			template<class InputIt>
-			T parallel_pdf(InputIt first, InputIt last, const std::vector<T> &x, T lambda) const
+			void set_thread_pool(std::shared_ptr<ThreadPool> in_pool)
 			{
-				T res = 0.0;
-				const auto size = last - first;
-				const auto nthreads = std::thread::hardware_concurrency();
+				pool = std::move(in_pool);
+			}
+			void set_support_pruning(bool enable)
+			{
+				support_pruning = enable;
+				if(sample)
+					build_support_index();
+			}
+			T cdf(const std::vector<T> &x, const T lambda = 1.0) const
+			{
+				if(!support_order.empty())
+					return pruned_cdf(x, lambda);
+				const size_t *weight = nullptr;
+				if(!repeat_number->empty())
+				{
+					if(repeat_number->size() != sample->size())
+						throw std::logic_error("times != sample");
+					weight = repeat_number->data();
+				}
+				if(sample->size() < 1000000)
+				{
+					return cdf(sample->begin(), sample->end(), weight, x, lambda)/count;
+				}
+				else
+				{
+					return parallel_cdf(sample->begin(), sample->end(), weight, x, lambda);
+				}
+			}
+			std::vector<T> get_bandwidth() const
+			{
+				return bandwidth;
+			}
+		protected:
+			template<typename InputIt>
+			T pdf_it(InputIt first, InputIt last, const size_t *weight, const std::vector<T> &x, T lambda) const
+			{
+				return (this->*kernel_sum)(first, last, weight, x, lambda);
+			}
+			template <typename Kernel>
+			void use_kernel()
+			{
+				kernel_sum = &KDE<T>::template sum_kernel<Kernel>;
+				kernel_tile = &KDE<T>::template sum_tile<Kernel>;
+				kernel_pruned = &KDE<T>::template sum_pruned<Kernel>;
+			}
+			// called whenever the sample or the bandwidth changes, the columnar copy is
+			// only built again by the next pdf_many
+			void reset_flat_sample()
+			{
+				std::lock_guard<std::mutex> lock(flat_mutex);
+				flat_ready = false;
+				std::vector<T>().swap(flat_sample);
+				std::vector<T>().swap(flat_weight);
+			}
+			void build_flat_sample() const
+			{
+				if(flat_ready)
+					return;
+				std::lock_guard<std::mutex> lock(flat_mutex);
+				if(flat_ready)
+					return;
+				const size_t n = sample->size();
+				flat_sample.resize(n*dimension);
+				for(size_t i = 0; i != n; i++)
+				{
+					const auto &p = (*sample)[i];
+					for(size_t j = 0; j != dimension; j++)
+						flat_sample[j*n + i] = p[j]*inv_bandwidth[j];
+				}
+				flat_weight.assign(repeat_number->begin(), repeat_number->end());
+				flat_ready = true;
+			}
+			unsigned int get_thread_count() const
+			{
+				unsigned int nthreads = pool ? static_cast<unsigned int>(pool->size()) : std::thread::hardware_concurrency();
+				return nthreads > 0 ? nthreads : 1;
+			}
+			// tasks go to the injected pool if there is one
+			template <typename F>
+			std::future<T> launch(F f) const
+			{
+				if(pool)
+					return pool->submit(std::move(f));
+				return std::async(std::move(f));
+			}
+			// product kernel summed over [first, last) in blocks: the per-dimension loop
+			// over a block has no branches or calls for the polynomial kernels, and the
+			// exponential kernels sum exponents so that each sample costs one exp
+			template <typename Kernel>
+			T sum_kernel(sample_iterator first, sample_iterator last, const size_t *weight, const std::vector<T> &x, T lambda) const
+			{
+				constexpr size_t block = 64;
+				T acc[block];
+				T norm = 1.0;
+				for(size_t i = 0; i != dimension; i++)
+					norm *= Kernel::norm(bandwidth[i], lambda);
+				T res = 0.0;
+				while(first != last)
+				{
+					const size_t n = std::min<size_t>(block, std::distance(first, last));
+					std::fill(acc, acc + n, Kernel::exponential ? 0.0 : 1.0);
+					for(size_t i = 0; i != dimension; i++)
+					{
+						const T xi = x[i], hi = inv_bandwidth[i];
+						for(size_t k = 0; k != n; k++)
+						{
+							const T z = (xi - first[k][i])*hi;
+							if constexpr(Kernel::exponential)
+								acc[k] += Kernel::exponent(z, lambda);
+							else
+								acc[k] *= Kernel::shape(z, lambda);
+						}
+					}
+					if constexpr(Kernel::exponential)
+					{
+						for(size_t k = 0; k != n; k++)
+							acc[k] = std::exp(acc[k]);
+					}
+					if(weight != nullptr)
+					{
+						for(size_t k = 0; k != n; k++)
+							res += acc[k]*weight[k];
+						weight += n;
+					}
+					else
+					{
+						for(size_t k = 0; k != n; k++)
+							res += acc[k];
+					}
+					first += n;
+				}
+				return res*norm;
+			}
+			// pdf of m row-major queries over the flat sample: every block of the
+			// sample is loaded once and evaluated against all m queries
+			template <typename Kernel>
+			void sum_tile(const T *queries, size_t m, T *out, T lambda) const
+			{
+				constexpr size_t block = 256;
+				const size_t n = sample->size();
+				T acc[block];
+				T norm = 1.0;
+				for(size_t i = 0; i != dimension; i++)
+					norm *= Kernel::norm(bandwidth[i], lambda);
+				std::vector<T> scaled(m*dimension);
+				for(size_t q = 0; q != m; q++)
+				{
+					for(size_t i = 0; i != dimension; i++)
+						scaled[q*dimension + i] = queries[q*dimension + i]*inv_bandwidth[i];
+				}
+				std::fill(out, out + m, 0.0);
+				for(size_t first = 0; first < n; first += block)
+				{
+					const size_t len = std::min(block, n - first);
+					for(size_t q = 0; q != m; q++)
+					{
+						std::fill(acc, acc + len, Kernel::exponential ? 0.0 : 1.0);
+						for(size_t i = 0; i != dimension; i++)
+						{
+							const T xi = scaled[q*dimension + i];
+							const T *column = flat_sample.data() + i*n + first;
+							for(size_t k = 0; k != len; k++)
+							{
+								const T z = xi - column[k];
+								if constexpr(Kernel::exponential)
+									acc[k] += Kernel::exponent(z, lambda);
+								else
+									acc[k] *= Kernel::shape(z, lambda);
+							}
+						}
+						T res = 0.0;
+						if(!flat_weight.empty())
+						{
+							const T *weight = flat_weight.data() + first;
+							for(size_t k = 0; k != len; k++)
+							{
+								if constexpr(Kernel::exponential)
+									res += std::exp(acc[k])*weight[k];
+								else
+									res += acc[k]*weight[k];
+							}
+						}
+						else
+						{
+							for(size_t k = 0; k != len; k++)
+							{
+								if constexpr(Kernel::exponential)
+									res += std::exp(acc[k]);
+								else
+									res += acc[k];
+							}
+						}
+						out[q] += res;
+					}
+				}
+				for(size_t q = 0; q != m; q++)
+					out[q] *= norm/count;
+			}
+			template<typename InputIt>
+			T cdf(InputIt first, InputIt last, const size_t *weight, const std::vector<T> &x, T lambda) const
+			{
+				T res = 0.0;
+				for(auto it = first; it != last; ++it)
+				{
+					T t = weight ? static_cast<T>(*weight++) : 1.0;
+					for(size_t i = 0; i != dimension; i++)
+					{
+						t *= compute_cdf(kernel_type, x[i], (*it)[i], bandwidth[i], lambda);
+					}
+					res += t;
+				}
+				return res;
+			}
+			template<class InputIt>
+			T parallel_pdf(InputIt first, InputIt last, const size_t *weight, const std::vector<T> &x, T lambda) const
+			{
+				T res = 0.0;
+				const auto size = last - first;
+				const auto nthreads = get_thread_count();
 				const auto size_per_thread = size / nthreads;
 
 				std::vector<std::future<T>> futures;
 				for(unsigned int i = 0; i < nthreads - 1; i++)
 				{
-					futures.emplace_back(std::async([start = first + i * size_per_thread, size_per_thread, x, lambda, this]()
+					futures.emplace_back(launch([start = first + i * size_per_thread, size_per_thread, w = weight ? weight + i * size_per_thread : nullptr, x, lambda, this]()
 					{
-						return this->pdf_it(start, start + size_per_thread, x, lambda);
+						return this->pdf_it(start, start + size_per_thread, w, x, lambda);
 					}));
 				}
 				futures.emplace_back(
-				  std::async([start = first + (nthreads - 1) * size_per_thread, last, x, lambda, this]()
+				  launch([start = first + (nthreads - 1) * size_per_thread, last, w = weight ? weight + (nthreads - 1) * size_per_thread : nullptr, x, lambda, this]()
 				{
-					return this->pdf_it(start, last, x, lambda);
+					return this->pdf_it(start, last, w, x, lambda);
 				}));
 
 				for(auto &&future : futures)
@@ -384,25 +1027,25 @@ namespace mveqf
 			}
 
 			template<class InputIt>
-			T parallel_cdf(InputIt first, InputIt last, const std::vector<T> &x, T lambda) const
+			T parallel_cdf(InputIt first, InputIt last, const size_t *weight, const std::vector<T> &x, T lambda) const
 			{
 				T res = 0.0;
 				const auto size = last - first;
-				const auto nthreads = std::thread::hardware_concurrency();
+				const auto nthreads = get_thread_count();
 				const auto size_per_thread = size / nthreads;
 
 				std::vector<std::future<T>> futures;
 				for(unsigned int i = 0; i < nthreads - 1; i++)
 				{
-					futures.emplace_back(std::async([start = first + i * size_per_thread, size_per_thread, x, lambda, this]()
+					futures.emplace_back(launch([start = first + i * size_per_thread, size_per_thread, w = weight ? weight + i * size_per_thread : nullptr, x, lambda, this]()
 					{
-						return this->cdf(start, start + size_per_thread, x, lambda);
+						return this->cdf(start, start + size_per_thread, w, x, lambda);
 					}));
 				}
 				futures.emplace_back(
-				  std::async([start = first + (nthreads - 1) * size_per_thread, last, x, lambda, this]()
+				  launch([start = first + (nthreads - 1) * size_per_thread, last, w = weight ? weight + (nthreads - 1) * size_per_thread : nullptr, x, lambda, this]()
 				{
-					return this->cdf(start, last, x, lambda);
+					return this->cdf(start, last, w, x, lambda);
 				}));
 
 				for(auto &&future : futures)
@@ -421,10 +1064,223 @@ namespace mveqf
 
 			size_t dimension;
 			size_t kernel_type; // 0 - gaussian, 1 - epanechnikov, 2 - uniform, 3 - biweight, 4 - triweight
+			size_t bandwidth_type;
+			size_t interpolation;
 			size_t count;
 			std::vector<T> sum, ssum, min, max, bandwidth;
 			std::shared_ptr<sample_type> sample;
 			std::shared_ptr<std::vector<size_t>> repeat_number;
+			kernel_sum_type kernel_sum;
+			kernel_tile_type kernel_tile;
+			kernel_pruned_type kernel_pruned;
+			std::shared_ptr<ThreadPool> pool;
+
+			// the sample stored by dimension, flat_sample[j*sample->size() + i] is
+			// coordinate j of point i divided by bandwidth[j]; flat_weight holds the
+			// repeat counts, empty for an unweighted sample. Only pdf_many reads them,
+			// so they are built by its first call
+			mutable std::vector<T> flat_sample;
+			mutable std::vector<T> flat_weight;
+			mutable std::atomic<bool> flat_ready{false};
+			mutable std::mutex flat_mutex;
+			// 1/bandwidth, updated by calculate_bandwidth
+			std::vector<T> inv_bandwidth;
+
+			// spatial index for the compactly supported kernels: the sample sorted by
+			// its first coordinate and, when 3^dimension cells are few enough, cells
+			// one bandwidth wide, the support of a query lies in its 3^d neighbouring
+			// cells. Cells are numbered in mixed radix, the points of cell_id[k] are
+			// cell_points[cell_start[k]..cell_start[k + 1])
+			bool support_pruning = true;
+			std::vector<size_t> support_order;
+			std::vector<T> support_key;
+			std::vector<T> cell_origin;
+			std::vector<size_t> cell_radix;
+			std::vector<size_t> cell_id;
+			std::vector<size_t> cell_start;
+			std::vector<size_t> cell_points;
+
+			bool is_compact() const
+			{
+				return kernel_type >= 1 && kernel_type <= 4;
+			}
+			T get_support(size_t j) const
+			{
+				return kernel_type == 2 ? 0.5*bandwidth[j] : bandwidth[j];
+			}
+			T get_weight(size_t i) const
+			{
+				return repeat_number->empty() ? 1.0 : static_cast<T>((*repeat_number)[i]);
+			}
+			void build_support_index()
+			{
+				support_order.clear();
+				support_key.clear();
+				cell_id.clear();
+				cell_start.clear();
+				cell_points.clear();
+				if(!support_pruning || !is_compact() || sample->empty())
+					return;
+				for(size_t j = 0; j != dimension; j++)
+				{
+					if(!(bandwidth[j] > 0.0))
+						return;
+				}
+				if(!repeat_number->empty() && repeat_number->size() != sample->size())
+					throw std::logic_error("times != sample");
+
+				support_order.resize(sample->size());
+				std::iota(support_order.begin(), support_order.end(), 0);
+				std::sort(support_order.begin(), support_order.end(), [this](size_t l, size_t r)
+				{
+					return (*sample)[l][0] < (*sample)[r][0];
+				});
+				support_key.resize(sample->size());
+				for(size_t i = 0; i != support_order.size(); i++)
+					support_key[i] = (*sample)[support_order[i]][0];
+
+				size_t neighbours = 1;
+				for(size_t j = 0; j != dimension && neighbours <= sample->size(); j++)
+					neighbours *= 3;
+				if(neighbours > sample->size())
+					return;
+				cell_origin = std::vector<T>(dimension, std::numeric_limits<T>::max());
+				std::vector<T> extent(dimension, std::numeric_limits<T>::lowest());
+				for(const auto &p : *sample)
+				{
+					for(size_t j = 0; j != dimension; j++)
+					{
+						cell_origin[j] = p[j] < cell_origin[j] ? p[j] : cell_origin[j];
+						extent[j] = p[j] > extent[j] ? p[j] : extent[j];
+					}
+				}
+				// a grid with more cells than size_t can number is left to the scan
+				cell_radix.resize(dimension);
+				size_t cells = 1;
+				for(size_t j = 0; j != dimension; j++)
+				{
+					const T r = std::floor((extent[j] - cell_origin[j])/bandwidth[j]) + 1.0;
+					if(!(r < static_cast<T>(std::numeric_limits<size_t>::max()/cells)))
+						return;
+					cell_radix[j] = static_cast<size_t>(r);
+					cells *= cell_radix[j];
+				}
+				std::vector<std::pair<size_t, size_t>> keyed(sample->size());
+				for(size_t i = 0; i != sample->size(); i++)
+				{
+					size_t id = 0;
+					for(size_t j = 0; j != dimension; j++)
+						id = id*cell_radix[j] + std::min(cell_radix[j] - 1, static_cast<size_t>(((*sample)[i][j] - cell_origin[j])/bandwidth[j]));
+					keyed[i] = std::make_pair(id, i);
+				}
+				std::sort(keyed.begin(), keyed.end());
+				cell_points.resize(keyed.size());
+				for(size_t k = 0; k != keyed.size(); k++)
+				{
+					if(k == 0 || keyed[k].first != keyed[k - 1].first)
+					{
+						cell_id.push_back(keyed[k].first);
+						cell_start.push_back(k);
+					}
+					cell_points[k] = keyed[k].second;
+				}
+				cell_start.push_back(keyed.size());
+				if(neighbours > cell_id.size())
+				{
+					cell_id.clear();
+					cell_start.clear();
+					cell_points.clear();
+				}
+			}
+			// calls f(i) for every sample point i that may lie in the support around x
+			template <typename F>
+			void visit_support(const std::vector<T> &x, F f) const
+			{
+				if(!cell_id.empty())
+				{
+					std::vector<size_t> first(dimension), last(dimension), key(dimension);
+					for(size_t j = 0; j != dimension; j++)
+					{
+						T c = std::floor((x[j] - cell_origin[j])/bandwidth[j]);
+						if(c + 1.0 < 0.0 || c - 1.0 >= static_cast<T>(cell_radix[j]))
+							return;
+						first[j] = c > 0.0 ? static_cast<size_t>(c) - 1 : 0;
+						last[j] = std::min(cell_radix[j] - 1, static_cast<size_t>(c + 1.0));
+						key[j] = first[j];
+					}
+					while(true)
+					{
+						size_t id = 0;
+						for(size_t j = 0; j != dimension; j++)
+							id = id*cell_radix[j] + key[j];
+						auto it = std::lower_bound(cell_id.begin(), cell_id.end(), id);
+						if(it != cell_id.end() && *it == id)
+						{
+							const size_t k = std::distance(cell_id.begin(), it);
+							for(size_t i = cell_start[k]; i != cell_start[k + 1]; i++)
+								f(cell_points[i]);
+						}
+						size_t j = dimension;
+						while(true)
+						{
+							if(j == 0)
+								return;
+							--j;
+							if(key[j] != last[j])
+							{
+								++key[j];
+								break;
+							}
+							key[j] = first[j];
+						}
+					}
+				}
+				T s0 = get_support(0);
+				auto a = std::lower_bound(support_key.begin(), support_key.end(), x[0] - s0);
+				auto b = std::upper_bound(a, support_key.end(), x[0] + s0);
+				for(auto it = a; it != b; ++it)
+					f(support_order[std::distance(support_key.begin(), it)]);
+			}
+			// pdf over the points that may lie in the support of x, the pruned kernels
+			// are compact so a product of shapes is zero outside
+			template <typename Kernel>
+			T sum_pruned(const std::vector<T> &x, T lambda) const
+			{
+				T norm = 1.0;
+				for(size_t j = 0; j != dimension; j++)
+					norm *= Kernel::norm(bandwidth[j], lambda);
+				T res = 0.0;
+				visit_support(x, [&](size_t i)
+				{
+					const auto &p = (*sample)[i];
+					T t = 1.0;
+					for(size_t j = 0; j != dimension && t != 0.0; j++)
+					{
+						const T z = (x[j] - p[j])*inv_bandwidth[j];
+						if constexpr(Kernel::exponential)
+							t *= std::exp(Kernel::exponent(z, lambda));
+						else
+							t *= Kernel::shape(z, lambda);
+					}
+					res += t*get_weight(i);
+				});
+				return res*norm/count;
+			}
+			// a point above x + support in the first coordinate adds nothing to the cdf
+			T pruned_cdf(const std::vector<T> &x, T lambda) const
+			{
+				T res = 0.0;
+				auto last = std::upper_bound(support_key.begin(), support_key.end(), x[0] + get_support(0));
+				for(size_t k = 0, n = std::distance(support_key.begin(), last); k != n; k++)
+				{
+					const auto &p = (*sample)[support_order[k]];
+					T t = get_weight(support_order[k]);
+					for(size_t j = 0; j != dimension && t != 0.0; j++)
+						t *= compute_cdf(kernel_type, x[j], p[j], bandwidth[j], lambda);
+					res += t;
+				}
+				return res/count;
+			}
 
 			void calculate_bandwidth()
 			{
@@ -443,6 +1299,561 @@ namespace mveqf
 						bandwidth[i] = 1.0;
 					}
 				}
+				else if(bandwidth_type != 0 && count > 1)
+				{
+					std::vector<std::future<T>> futures;
+					for(size_t i = 0; i != dimension; i++)
+					{
+						if(bandwidth[i] > 0.0)
+						{
+							futures.emplace_back(launch([this, i]()
+							{
+								return select_bandwidth(i);
+							}));
+						}
+					}
+					for(size_t i = 0, k = 0; i != dimension; i++)
+					{
+						if(bandwidth[i] > 0.0)
+							bandwidth[i] = futures[k++].get();
+					}
+				}
+				inv_bandwidth.resize(dimension);
+				for(size_t i = 0; i != dimension; i++)
+					inv_bandwidth[i] = 1.0/bandwidth[i];
+			}
+			// distance in bandwidths beyond which the kernel is negligible
+			T get_kernel_reach() const
+			{
+				switch(kernel_type)
+				{
+					case 1:
+					case 3:
+					case 4:
+						return 1.0;
+					case 2:
+						return 0.5;
+					case 5:
+						return 20.0;
+					default:
+						return 6.0;
+				}
+			}
+			// cross-validated bandwidth of dimension j: the marginal sample is binned
+			// once (linearly for least squares, to the nearest bin for the likelihood
+			// so that the leave-one-out density stays positive), the score of a bandwidth is then a discrete convolution of
+			// the occupied bins with the kernel, leave-one-out terms take away the
+			// kernel's own contribution at the bin; the rule-of-thumb bandwidth
+			// h0 = bandwidth[j] is refined within [h0/25, 4*h0], but not below two bins
+			T select_bandwidth(size_t j) const
+			{
+				const size_t nbins = 4096;
+				const T h0 = bandwidth[j];
+				const T h_max = 4.0*h0;
+				const T pad = get_kernel_reach()*h_max;
+				const T a = min[j] - pad;
+				const T delta = (max[j] - min[j] + 2.0*pad)/(nbins - 1);
+				const T h_min = std::min<T>(h0, std::max<T>(T(0.04)*h0, T(2)*delta));
+
+				std::vector<T> bins(nbins, 0.0);
+				for(size_t i = 0; i != sample->size(); i++)
+				{
+					const T w = repeat_number->empty() ? 1.0 : static_cast<T>((*repeat_number)[i]);
+					const T t = ((*sample)[i][j] - a)/delta;
+					if(bandwidth_type == 2)
+					{
+						bins[std::min(static_cast<size_t>(t + 0.5), nbins - 1)] += w;
+						continue;
+					}
+					const size_t l = std::min(static_cast<size_t>(t), nbins - 2);
+					const T frac = t - l;
+					bins[l] += w*(1.0 - frac);
+					bins[l + 1] += w*frac;
+				}
+				std::vector<size_t> occupied;
+				for(size_t l = 0; l != nbins; l++)
+				{
+					if(bins[l] > 0.0)
+						occupied.push_back(l);
+				}
+
+				const T n = count;
+				auto score = [&](T h)
+				{
+					// kernel taps normalised so that they integrate to one on the grid
+					const size_t reach = std::min(nbins - 1, static_cast<size_t>(get_kernel_reach()*h/delta));
+					std::vector<T> taps(reach + 1);
+					T total = 0.0;
+					for(size_t k = 0; k <= reach; k++)
+					{
+						taps[k] = compute_pdf(kernel_type, k*delta, 0.0, h, 1.0);
+						total += k == 0 ? taps[k] : 2.0*taps[k];
+					}
+					if(!(total > 0.0))
+						return std::numeric_limits<T>::max();
+					for(auto &k : taps)
+						k /= total*delta;
+
+					std::vector<T> density(nbins, 0.0);
+					for(auto l : occupied)
+					{
+						const size_t first = l > reach ? l - reach : 0;
+						const size_t last = std::min(nbins - 1, l + reach);
+						for(size_t k = first; k <= last; k++)
+							density[k] += bins[l]*taps[k > l ? k - l : l - k];
+					}
+					T res = 0.0;
+					if(bandwidth_type == 2)
+					{
+						for(auto l : occupied)
+						{
+							const T loo = (density[l] - taps[0])/(n - 1.0);
+							if(!(loo > 0.0))
+								return std::numeric_limits<T>::max();
+							res -= bins[l]*std::log(loo);
+						}
+					}
+					else
+					{
+						T square = 0.0, loo = 0.0;
+						for(auto k : density)
+							square += k*k;
+						for(auto l : occupied)
+							loo += bins[l]*(density[l] - taps[0]);
+						res = square*delta/(n*n) - 2.0*loo/(n*(n - 1.0));
+					}
+					return res;
+				};
+
+				// coarse log-spaced scan followed by a golden section search
+				const size_t steps = 32;
+				const T log_min = std::log(h_min), log_step = (std::log(h_max) - log_min)/(steps - 1);
+				size_t best = 0;
+				T best_score = std::numeric_limits<T>::max();
+				for(size_t k = 0; k != steps; k++)
+				{
+					T t = score(std::exp(log_min + k*log_step));
+					if(t < best_score)
+					{
+						best_score = t;
+						best = k;
+					}
+				}
+				if(best_score == std::numeric_limits<T>::max())
+					return h0;
+				T lo = log_min + (best > 0 ? best - 1 : 0)*log_step;
+				T hi = log_min + std::min(best + 1, steps - 1)*log_step;
+				const T ratio = 0.5*(std::sqrt(5.0) - 1.0);
+				T x1 = hi - ratio*(hi - lo), x2 = lo + ratio*(hi - lo);
+				T f1 = score(std::exp(x1)), f2 = score(std::exp(x2));
+				for(size_t k = 0; k != 20; k++)
+				{
+					if(f1 < f2)
+					{
+						hi = x2;
+						x2 = x1;
+						f2 = f1;
+						x1 = hi - ratio*(hi - lo);
+						f1 = score(std::exp(x1));
+					}
+					else
+					{
+						lo = x1;
+						x1 = x2;
+						f1 = f2;
+						x2 = lo + ratio*(hi - lo);
+						f2 = score(std::exp(x2));
+					}
+				}
+				T res = std::exp(0.5*(lo + hi));
+				return score(res) <= best_score ? res : std::exp(log_min + best*log_step);
+			}
+		};
+
+		// KDE evaluated over a kd-tree of the sample. A node whose kernel values are
+		// known to lie within the error budget is replaced by its weight times the
+		// midpoint of the bounds, the result is within
+		// abs_err + rel_err*pdf(x) of the exact KDE::pdf.
+		template <typename T>
+		class TreeKDE : public KDE<T>
+		{
+		protected:
+			using KDE<T>::compute_pdf;
+			using KDE<T>::dimension;
+			using KDE<T>::kernel_type;
+			using KDE<T>::count;
+			using KDE<T>::bandwidth;
+			using KDE<T>::sample;
+			using KDE<T>::repeat_number;
+			using KDE<T>::get_weight;
+			using KDE<T>::support_pruning;
+
+			typedef typename KDE<T>::sample_type sample_type;
+
+			struct TreeNode
+			{
+				size_t first, last;
+				size_t left, right;
+				T weight;
+				std::vector<T> lo, hi;
+			};
+
+			std::vector<TreeNode> tree;
+			std::vector<size_t> order;
+			size_t leaf_size;
+			T abs_err, rel_err;
+
+			size_t build(size_t first, size_t last)
+			{
+				TreeNode node;
+				node.first = first;
+				node.last = last;
+				node.left = node.right = 0;
+				node.weight = 0.0;
+				node.lo = std::vector<T>(dimension, std::numeric_limits<T>::max());
+				node.hi = std::vector<T>(dimension, std::numeric_limits<T>::lowest());
+				for(size_t i = first; i != last; i++)
+				{
+					const auto &p = (*sample)[order[i]];
+					for(size_t j = 0; j != dimension; j++)
+					{
+						node.lo[j] = p[j] < node.lo[j] ? p[j] : node.lo[j];
+						node.hi[j] = p[j] > node.hi[j] ? p[j] : node.hi[j];
+					}
+					node.weight += get_weight(order[i]);
+				}
+				size_t id = tree.size();
+				tree.push_back(node);
+				if(last - first <= leaf_size)
+					return id;
+
+				// split the widest side, measured in bandwidths, at the median
+				size_t axis = 0;
+				T widest = -1.0;
+				for(size_t j = 0; j != dimension; j++)
+				{
+					T w = (node.hi[j] - node.lo[j])/bandwidth[j];
+					if(w > widest)
+					{
+						widest = w;
+						axis = j;
+					}
+				}
+				if(widest <= 0.0)
+					return id;
+				size_t middle = first + (last - first)/2;
+				std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [this, axis](size_t l, size_t r)
+				{
+					return (*sample)[l][axis] < (*sample)[r][axis];
+				});
+				size_t left = build(first, middle);
+				size_t right = build(middle, last);
+				tree[id].left = left;
+				tree[id].right = right;
+				return id;
+			}
+			// kernel product at the nearest and the farthest point of the node box
+			std::pair<T, T> kernel_bounds(const TreeNode &node, const std::vector<T> &x, T lambda) const
+			{
+				T kmin = 1.0, kmax = 1.0;
+				for(size_t j = 0; j != dimension; j++)
+				{
+					T near = 0.0, far = 0.0;
+					if(x[j] < node.lo[j])
+					{
+						near = node.lo[j] - x[j];
+						far = node.hi[j] - x[j];
+					}
+					else if(x[j] > node.hi[j])
+					{
+						near = x[j] - node.hi[j];
+						far = x[j] - node.lo[j];
+					}
+					else
+					{
+						far = std::max(x[j] - node.lo[j], node.hi[j] - x[j]);
+					}
+					kmax *= compute_pdf(kernel_type, near, 0.0, bandwidth[j], lambda);
+					kmin *= compute_pdf(kernel_type, far, 0.0, bandwidth[j], lambda);
+				}
+				return std::make_pair(kmin, kmax);
+			}
+			// lower is a running lower bound of the unnormalised sum, the budget of a
+			// node is proportional to its weight
+			T evaluate(size_t id, T kmin, T kmax, const std::vector<T> &x, T lambda, T &lower) const
+			{
+				const TreeNode &node = tree[id];
+				if(kmax <= 0.0)
+					return 0.0;
+				T budget = (count*abs_err + rel_err*lower)/tree.front().weight;
+				if(0.5*(kmax - kmin) <= budget)
+					return 0.5*node.weight*(kmax + kmin);
+				if(node.left == 0)
+				{
+					T res = 0.0;
+					for(size_t i = node.first; i != node.last; i++)
+					{
+						const auto &p = (*sample)[order[i]];
+						T t = 1.0;
+						for(size_t j = 0; j != dimension; j++)
+						{
+							t *= compute_pdf(kernel_type, x[j], p[j], bandwidth[j], lambda);
+						}
+						res += get_weight(order[i])*t;
+					}
+					lower += res - node.weight*kmin;
+					return res;
+				}
+				auto l = kernel_bounds(tree[node.left], x, lambda);
+				auto r = kernel_bounds(tree[node.right], x, lambda);
+				lower += tree[node.left].weight*l.first + tree[node.right].weight*r.first - node.weight*kmin;
+				// the closer child first tightens the lower bound sooner
+				if(l.second >= r.second)
+				{
+					T res = evaluate(node.left, l.first, l.second, x, lambda, lower);
+					return res + evaluate(node.right, r.first, r.second, x, lambda, lower);
+				}
+				T res = evaluate(node.right, r.first, r.second, x, lambda, lower);
+				return res + evaluate(node.left, l.first, l.second, x, lambda, lower);
+			}
+		public:
+			TreeKDE() : leaf_size(32), abs_err(0.0), rel_err(1e-3)
+			{
+				support_pruning = false;
+			}
+			TreeKDE(const TreeKDE&) = delete;
+			TreeKDE& operator=(const TreeKDE&) = delete;
+
+			void set_error_bounds(T in_abs_err, T in_rel_err)
+			{
+				if(in_abs_err < 0.0 || in_rel_err < 0.0)
+					throw std::logic_error("error bounds must be non-negative");
+				abs_err = in_abs_err;
+				rel_err = in_rel_err;
+			}
+			void set_leaf_size(size_t size)
+			{
+				leaf_size = size > 0 ? size : 1;
+			}
+			void set_sample_shared(std::shared_ptr<sample_type> in_sample)
+			{
+				KDE<T>::set_sample_shared(std::move(in_sample));
+				build_tree();
+			}
+			void set_sample_shared(std::shared_ptr<sample_type> in_sample, std::shared_ptr<std::vector<size_t>> repeat_count)
+			{
+				KDE<T>::set_sample_shared(std::move(in_sample), std::move(repeat_count));
+				if(repeat_number->size() != sample->size())
+					throw std::logic_error("times != sample");
+				build_tree();
+			}
+			void build_tree()
+			{
+				tree.clear();
+				order.resize(sample->size());
+				std::iota(order.begin(), order.end(), 0);
+				if(!order.empty())
+					build(0, order.size());
+			}
+			T pdf(const std::vector<T> &x, const T lambda = 1.0) const
+			{
+				if(tree.empty())
+					return 0.0;
+				auto b = kernel_bounds(tree.front(), x, lambda);
+				T lower = tree.front().weight*b.first;
+				return evaluate(0, b.first, b.second, x, lambda, lower)/count;
+			}
+			size_t get_node_count() const
+			{
+				return tree.size();
+			}
+		};
+
+
+		// KDE over a sample binned onto the regular grid of the quantile function
+		// (gridn cells of width (ub - lb)/gridn per dimension). Only occupied cells
+		// are stored, each with the total weight of its points placed at the cell
+		// centre. pdf() visits the occupied cells inside the kernel support around
+		// the query using separable per-dimension kernel weights, the Gaussian and
+		// Laplacian kernels are truncated at cutoff bandwidths.
+		template <typename T>
+		class BinnedKDE : public KDE<T>
+		{
+		protected:
+			using KDE<T>::compute_pdf;
+			using KDE<T>::dimension;
+			using KDE<T>::kernel_type;
+			using KDE<T>::count;
+			using KDE<T>::bandwidth;
+			using KDE<T>::sample;
+			using KDE<T>::repeat_number;
+			using KDE<T>::support_pruning;
+
+			typedef typename KDE<T>::sample_type sample_type;
+
+			std::vector<T> lb, ub, width;
+			std::vector<size_t> grid_number;
+			T cutoff;
+
+			std::vector<std::vector<size_t>> cells;
+			std::vector<T> cell_weight;
+			std::unordered_map<std::vector<size_t>, size_t, CellHasher> cell_index;
+
+			size_t get_cell(size_t j, T value) const
+			{
+				T t = std::floor((value - lb[j])/width[j]);
+				if(t < 0.0)
+					return 0;
+				size_t k = static_cast<size_t>(t);
+				return k < grid_number[j] ? k : grid_number[j] - 1;
+			}
+			T get_center(size_t j, size_t k) const
+			{
+				return lb[j] + width[j]*(k + 0.5);
+			}
+			T get_cutoff_support(size_t j, T lambda) const
+			{
+				switch(kernel_type)
+				{
+					case 1:
+					case 3:
+					case 4:
+						return bandwidth[j];
+					case 2:
+						return 0.5*bandwidth[j];
+					case 5:
+						return cutoff*bandwidth[j]/lambda;
+					default:
+						return cutoff*bandwidth[j];
+				}
+			}
+		public:
+			BinnedKDE() : cutoff(5.0)
+			{
+				support_pruning = false;
+			}
+			BinnedKDE(const BinnedKDE&) = delete;
+			BinnedKDE& operator=(const BinnedKDE&) = delete;
+
+			void set_grid(const std::vector<T> &in_lb, const std::vector<T> &in_ub, const std::vector<size_t> &in_gridn)
+			{
+				if(in_lb.size() != in_ub.size() || in_lb.size() != in_gridn.size())
+					throw std::logic_error("lb, ub and gridn sizes differ");
+				lb = in_lb;
+				ub = in_ub;
+				grid_number = in_gridn;
+				width.resize(lb.size());
+				for(size_t i = 0; i != lb.size(); i++)
+					width[i] = (ub[i] - lb[i])/T(grid_number[i]);
+			}
+			void set_cutoff(T in_cutoff)
+			{
+				cutoff = in_cutoff;
+			}
+			void set_sample_shared(std::shared_ptr<sample_type> in_sample)
+			{
+				KDE<T>::set_sample_shared(std::move(in_sample));
+				fill_bins();
+			}
+			void set_sample_shared(std::shared_ptr<sample_type> in_sample, std::shared_ptr<std::vector<size_t>> repeat_count)
+			{
+				KDE<T>::set_sample_shared(std::move(in_sample), std::move(repeat_count));
+				if(repeat_number->size() != sample->size())
+					throw std::logic_error("times != sample");
+				fill_bins();
+			}
+			void fill_bins()
+			{
+				if(grid_number.size() != dimension)
+					throw std::logic_error("grid is not set");
+				cells.clear();
+				cell_weight.clear();
+				cell_index.clear();
+				std::vector<size_t> key(dimension);
+				for(size_t i = 0; i != sample->size(); i++)
+				{
+					for(size_t j = 0; j != dimension; j++)
+						key[j] = get_cell(j, (*sample)[i][j]);
+					T w = repeat_number->empty() ? 1.0 : static_cast<T>((*repeat_number)[i]);
+					auto it = cell_index.find(key);
+					if(it == cell_index.end())
+					{
+						cell_index.emplace(key, cells.size());
+						cells.push_back(key);
+						cell_weight.push_back(w);
+					}
+					else
+					{
+						cell_weight[it->second] += w;
+					}
+				}
+			}
+			size_t get_cell_count() const
+			{
+				return cells.size();
+			}
+			T pdf(const std::vector<T> &x, const T lambda = 1.0) const
+			{
+				// per-dimension cell range inside the support and the kernel weights of its cells
+				std::vector<size_t> first(dimension), size(dimension);
+				std::vector<std::vector<T>> weights(dimension);
+				T volume = 1.0;
+				for(size_t j = 0; j != dimension; j++)
+				{
+					T support = get_cutoff_support(j, lambda);
+					if(x[j] + support < lb[j] || x[j] - support > ub[j])
+						return 0.0;
+					size_t a = get_cell(j, x[j] - support);
+					size_t b = get_cell(j, x[j] + support);
+					first[j] = a;
+					size[j] = b - a + 1;
+					weights[j].resize(size[j]);
+					for(size_t k = 0; k != size[j]; k++)
+						weights[j][k] = compute_pdf(kernel_type, x[j], get_center(j, a + k), bandwidth[j], lambda);
+					volume *= size[j];
+				}
+
+				T res = 0.0;
+				if(volume < static_cast<T>(cells.size()))
+				{
+					std::vector<size_t> offset(dimension, 0), key(first);
+					while(true)
+					{
+						auto it = cell_index.find(key);
+						if(it != cell_index.end())
+						{
+							T t = cell_weight[it->second];
+							for(size_t j = 0; j != dimension; j++)
+								t *= weights[j][offset[j]];
+							res += t;
+						}
+						size_t j = dimension;
+						while(j > 0)
+						{
+							--j;
+							if(++offset[j] != size[j])
+							{
+								key[j] = first[j] + offset[j];
+								break;
+							}
+							offset[j] = 0;
+							key[j] = first[j];
+							if(j == 0)
+								return res/count;
+						}
+					}
+				}
+				for(size_t i = 0; i != cells.size(); i++)
+				{
+					T t = cell_weight[i];
+					for(size_t j = 0; j != dimension && t != 0.0; j++)
+					{
+						size_t k = cells[i][j] - first[j];
+						t = cells[i][j] < first[j] || k >= size[j] ? 0.0 : t*weights[j][k];
+					}
+					res += t;
+				}
+				return res/count;
 			}
 		};
 
@@ -25,6 +25,10 @@
 //#include <utility/data_io.h>
 #include <random>
 #include <ctime>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 
 namespace mveqf
 {
@@ -40,141 +44,15 @@ namespace mveqf
 			using kde::Kernels<U>::compute_cdf;
 
 			size_t count;
-			U sum, ssum, min, max, bandwidth;
+			U bandwidth;
 
 			std::vector<U> sample;
+			std::vector<U> weight;
 
 			size_t kernel_type; // 0 - gauss, 1 - epanechnikov, 2 - uniform, 3 - biweight, 4 - triweight
 
-			void calculate_bandwidth(NodeCount<T> *layer)
-			{
-				U x = sum/count;
-				U y = ssum/count;
-				U sigma = std::sqrt(y - std::pow(x, 2.0));
-				bandwidth = sigma*(std::pow((3.0*count/4.0), (-1.0/5.0)));
-//        std::cout << bandwidth << std::endl;
-				if(layer->children.size() == 1)
-				{
-					bandwidth = 1.0;
-				}
-			}
-
-			U inverse(size_t ind, const std::vector<std::vector<U>> &grids, const U mu, U val01, U in_bandwidth, const U lambda) const
-			{
-				const U lower_bound = grids[ind].front();
-				const U upper_bound = grids[ind].back();
-
-				const U es = upper_bound - lower_bound;
-				const U min = compute_cdf(kernel_type, lower_bound, mu, in_bandwidth, lambda);
-				const U max = compute_cdf(kernel_type, upper_bound, mu, in_bandwidth, lambda);
-
-				const size_t n = 100000;
-				size_t c = n - 1, step;
-				U f1, f2, p1, p2;
-				size_t f = 0, i = 0;
-				while(c > 0)
-				{
-					i = f;
-					step = c / 2;
-					i = i + step;
-
-					p1 = lower_bound + es * i / (n - 1);
-					f1 = (compute_cdf(kernel_type, p1, mu, in_bandwidth, lambda) - min)/(max - min);
-					if(f1 < val01)
-					{
-						++i;
-						f = i;
-						c -= step + 1;
-					}
-					else
-						c = step;
-				}
-
-				p2 = lower_bound + es * (i + 1) / (n - 1);
-				f2 = (compute_cdf(kernel_type, p2, mu, in_bandwidth, lambda) - min)/(max - min);
-
-				U check = p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-				if(!std::isfinite(check))
-				{
-					size_t max_ind = 0;
-					for(size_t j = 0; j != n - 1; j++)
-					{
-						p2 = lower_bound + es * (j + 1) / (n - 1);
-						f2 = (compute_cdf(kernel_type, p2, mu, in_bandwidth, lambda)  - min)/(max - min);
-						if(f2 < 1.0)
-							max_ind = j;
-						if(f2 > val01)
-						{
-							p1 = lower_bound + es * j / (n - 1);
-							f1 = (compute_cdf(kernel_type, p1, mu, in_bandwidth, lambda)  - min)/(max - min);
-							return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-						}
-					}
-					std::cout << "fff" << std::endl;// std::fixed << '\t' << time.elapsed_seconds() << std::endl;
-//
-//        for(size_t j = 0; j != layer->children.size(); j++)
-//        {
-//            std::cout << layer->children[i]->count << std::endl;
-//        }
-//
-
-//        std::cin.get();
-					return lower_bound + es * max_ind / (n - 1);
-				}
-				if(!std::isnormal(check))
-				{
-//        std::cout << check << std::endl;
-
-//        std::cout.precision(20);
-//        std::cout << std::scientific << std::numeric_limits<float>::denorm_min() << std::endl;
-//        std::cout << std::scientific << std::numeric_limits<float>::lowest() << std::endl;
-//        std::cout << std::scientific << p1 << " + (" << val01 << " - " << f1 << " )*( " << p2 << " - " << p1 << " )/( " << f2 << " - " << f1 << " ) " << std::endl;
-//        std::cout << "fff" << std::endl;
-
-//        U t1 = (val01 - f1)*(p2 - p1);
-//        U t2 = t1/(f2 - f1);
-//        U check = p1 + t2;
-//        if(!std::isnormal(check))
-//            std::cout << "ff" << std::endl;
-
-
-
-
-					size_t max_ind = 0;
-					for(size_t j = 0; j != n - 1; j++)
-					{
-						p2 = lower_bound + es * (j + 1) / (n - 1);
-						f2 = (compute_cdf(kernel_type, p2, mu, in_bandwidth, lambda)  - min)/(max - min);
-						if(f2 < 1.0)
-							max_ind = j;
-						if(f2 > val01)
-						{
-							p1 = lower_bound + es * j / (n - 1);
-							f1 = (compute_cdf(kernel_type, p1, mu, in_bandwidth, lambda)  - min)/(max - min);
-							return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-						}
-					}
-					check = lower_bound + es * max_ind / (n - 1);
-					if(std::isnormal(check))
-					{
-						return check;
-					}
-					else
-					{
-						if(max_ind > 0)
-							return lower_bound + es * (max_ind - 1) / (n - 1);
-						else
-							return lower_bound + es * (max_ind + 1) / (n - 1);
-					}
-				}
-
-//    std::cout << std::fixed << '\t' << time.elapsed_seconds() << std::endl;
-
-				return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-			}
-
 		public:
-			Qkde():sum(0), ssum(0), min(std::numeric_limits<U>::max()), max(std::numeric_limits<U>::min()) {}
+			Qkde():count(0), bandwidth(1) {}
 			void set_kernel_type(size_t kt)
 			{
 //        if(kt >= 0 && kt < 5)
@@ -182,68 +60,33 @@ namespace mveqf
 //        else
 //            throw std::logic_error("kernel type");
 			}
+			// the smoothed conditional of the layer is a mixture of kernels centred at
+			// the children's cell centres, weighted by their counts
 			void set_sample(NodeCount<T> *layer, size_t ind, const std::vector<std::vector<U>> &grids, const std::vector<U> &dx, U in_bandwidth, U lambda)
 			{
 				count = 0;
-				size_t min_c = layer->count + 1, cc = 0;
+				sample.resize(layer->children.size());
+				weight.resize(layer->children.size());
 				for(size_t i = 0; i != layer->children.size(); i++)
 				{
-					if(layer->children[i]->count < min_c)
-					{
-						min_c = layer->children[i]->count;
-					}
-				}
-				min_c = min_c - 1;
-				for(size_t i = 0; i != layer->children.size(); i++)
-				{
-					cc += layer->children[i]->count - min_c;
-				}
-				sample.resize(cc);
-
-//        std::cout << sample.size() << std::endl;
-
-//        sample.resize(layer->count);
-				for(size_t i = 0; i != layer->children.size(); i++)
-				{
-//            U init_point = grids[ind][layer->children[i]->index] + dx[ind];
-//            for(size_t j = 0; j != layer->children[i]->count; j++)
-//            {
-//                sum += sample;
-//                ssum += std::pow(sample, 2.0);
-//            }
-//            size_t c = 0;
-					for(size_t j = 1; j != layer->children[i]->count - min_c + 1; j++)
-					{
-						U temp = j/U(layer->children[i]->count - min_c + 1);
-						//U inverse(size_t ind, const std::vector<std::vector<U>> &grids, const U mu, U val01, U in_bandwidth, const U lambda) const
-						U rez = inverse(ind, grids, grids[ind][layer->children[i]->index] + dx[ind], temp, in_bandwidth, lambda);
-						//U rez = grids[ind][layer->children[i]->index] + dx[ind] + myErfInv2(temp);
-//                std::cout << temp << std::endl;
-//                std::cin.get();
-						if(rez > grids[ind].front() && rez < grids[ind].back())
-						{
-							sample[count] = rez;
-							++count;
-						}
-						sum += rez;
-						ssum += std::pow(rez, 2.0);
-
-						min = rez < min ? rez : min;
-						max = rez > max ? rez : max;
-					}
-
-//            sum += sample*layer->children[i]->count;
-//            ssum += std::pow(sample, 2.0)*layer->children[i]->count;
-
-//            min = sample < min ? sample : min;
-//            max = sample > max ? sample : max;
+					const U centre = grids[ind][layer->children[i]->index] + dx[ind];
+					const size_t c = layer->children[i]->count;
+					sample[i] = centre;
+					weight[i] = c;
+					count += c;
 				}
-
-//        std::cout << sample.size() << std::endl;
-
-				sample.resize(count);
-				//count = layer->count;
-				calculate_bandwidth(layer);
+				bandwidth = in_bandwidth;
+			}
+			// derivative of cdf in x, compute_pdf of the biweight, triweight and
+			// laplacian kernels is not divided by the bandwidth
+			U pdf(U x, const U lambda = 1.0) const
+			{
+				U d = 0;
+				for(size_t i = 0; i != sample.size(); i++)
+					d += compute_pdf(kernel_type, x, sample[i], bandwidth, lambda)*weight[i];
+				if(kernel_type >= 3 && kernel_type <= 5)
+					d /= bandwidth;
+				return d/count;
 			}
 			U cdf(U x, /*trie_based::NodeCount<T> *layer, size_t ind, const std::vector<std::vector<U>> &grids, const std::vector<U> &dx,*/ const U lambda = 1.0) const
 			{
@@ -261,7 +104,7 @@ namespace mveqf
 				U d = 0;
 				for(size_t i = 0; i != sample.size(); i++)
 				{
-					d += compute_cdf(kernel_type, x, sample[i], bandwidth, lambda);
+					d += compute_cdf(kernel_type, x, sample[i], bandwidth, lambda)*weight[i];
 				}
 				return d/count;
 
@@ -360,22 +203,56 @@ namespace mveqf
 		using mveqf::ImplicitQuantile<T, U>::quantile_transform;
 
 		size_t kernel_type;
+		size_t interpolation;
+		bool smoothing;
 		std::vector<U> bandwidth;
+		std::shared_ptr<const kde::KernelTable<U>> kernel_table;
+
+		// smoothed conditional cdf of a node normalised to [0, 1] at
+		// cdf_table_size + 1 equally spaced points of the grid
+		struct CdfTable
+		{
+			U bandwidth, lambda;
+			std::vector<U> cdf;
+		};
+		typedef std::list<std::pair<const NodeCount<T>*, std::shared_ptr<const CdfTable>>> cdf_list;
+
+		// least recently used tables are evicted first once the budget in bytes
+		// is exceeded, a zero budget disables the cache
+		size_t cdf_cache_budget;
+		size_t cdf_table_size;
+		mutable size_t cdf_cache_bytes;
+		mutable cdf_list cdf_order;
+		mutable std::unordered_map<const NodeCount<T>*, typename cdf_list::iterator> cdf_cache;
+		mutable std::mutex cdf_mutex;
+		// tables computed ahead of time, never evicted and read without locking
+		std::unordered_map<const NodeCount<T>*, std::shared_ptr<const CdfTable>> cdf_tables;
 
 		U kquantile_transform(NodeCount<T> *layer, size_t ind, U val01, U in_bandwidth, const U lambda) const;
+		std::shared_ptr<const CdfTable> build_cdf_table(NodeCount<T> *layer, size_t ind, U in_bandwidth, const U lambda, size_t table_size) const;
+		std::shared_ptr<const CdfTable> get_cdf_table(NodeCount<T> *layer, size_t ind, U in_bandwidth, const U lambda) const;
+		std::vector<std::pair<NodeCount<T>*, size_t>> get_inner_nodes() const;
+		void clear_cdf_cache();
 	public:
 		ImplicitTrieKQuantile();
 		ImplicitTrieKQuantile(std::vector<U> in_lb, std::vector<U> in_ub, std::vector<size_t> in_gridn, size_t kt);
 		void set_kernel_type(size_t kt);
+		void set_interpolation(size_t it);
 		void set_sample_shared(std::shared_ptr<trie_type> in_sample);
 		void set_bandwidth(std::vector<U> in_bandwidth);
+		void set_smoothing(bool in_smoothing);
+		void set_cdf_cache(size_t budget, size_t table_size = 1024);
+		void precompute_cdf_tables(size_t min_count = 1024, const U lambda = 1.0, size_t table_size = 1024);
+		void save_cdf_tables(std::ostream &out) const;
+		void load_cdf_tables(std::istream &in);
 		void transform(const std::vector<U>& in01, std::vector<U>& out/*, const U lambda = 1.0*/) const override;
 //		std::vector<U> transform(const std::vector<U>& in01/*, const U lambda = 1.0*/) const;
 		std::vector<std::vector<U>> get_grid() const;
 		std::vector<U> get_dx() const;
 	};
 	template <typename T, typename U>
-	ImplicitTrieKQuantile<T, U>::ImplicitTrieKQuantile() : kernel_type(0)
+	ImplicitTrieKQuantile<T, U>::ImplicitTrieKQuantile() : kernel_type(0), interpolation(0), smoothing(false),
+		cdf_cache_budget(0), cdf_table_size(1024), cdf_cache_bytes(0)
 	{
 		grids.resize(grid_number.size());
 		for(size_t i = 0; i != grids.size(); i++)
@@ -395,7 +272,8 @@ namespace mveqf
 	ImplicitTrieKQuantile<T, U>::ImplicitTrieKQuantile(std::vector<U> in_lb,
 	    std::vector<U> in_ub,
 	    std::vector<size_t> in_gridn,
-	    size_t kt) : mveqf::ImplicitQuantile<T, U>(in_lb, in_ub, in_gridn), kernel_type(kt)
+	    size_t kt) : mveqf::ImplicitQuantile<T, U>(in_lb, in_ub, in_gridn), kernel_type(kt), interpolation(0), smoothing(false),
+		cdf_cache_budget(0), cdf_table_size(1024), cdf_cache_bytes(0)
 	{
 		grids.resize(grid_number.size());
 		for(size_t i = 0; i != grids.size(); i++)
@@ -415,39 +293,86 @@ namespace mveqf
 	void ImplicitTrieKQuantile<T, U>::set_sample_shared(std::shared_ptr<trie_type> in_sample)
 	{
 		sample = std::move(in_sample);
+		clear_cdf_cache();
+		cdf_tables.clear();
 	}
 	template <typename T, typename U>
 	void ImplicitTrieKQuantile<T, U>::set_kernel_type(size_t kt)
 	{
 		kernel_type = kt;
+		set_interpolation(interpolation);
+	}
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::set_cdf_cache(size_t budget, size_t table_size)
+	{
+		if(table_size < 1)
+			throw std::logic_error("table_size < 1");
+		cdf_cache_budget = budget;
+		cdf_table_size = table_size;
+		clear_cdf_cache();
+	}
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::clear_cdf_cache()
+	{
+		std::lock_guard<std::mutex> lock(cdf_mutex);
+		cdf_order.clear();
+		cdf_cache.clear();
+		cdf_cache_bytes = 0;
+	}
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::set_interpolation(size_t it)
+	{
+		// 0 - exact kernel cdf, 1 - linear, 2 - cubic interpolation of a table
+		// shared by all the Qkde objects built during the transform
+		interpolation = it;
+		if(interpolation == 0)
+			kernel_table = nullptr;
+		else
+			kernel_table = std::make_shared<const kde::KernelTable<U>>(kernel_type, interpolation);
+		clear_cdf_cache();
+		cdf_tables.clear();
 	}
 	template <typename T, typename U>
 	void ImplicitTrieKQuantile<T, U>::set_bandwidth(std::vector<U> in_bandwidth)
 	{
 		bandwidth = in_bandwidth;
 	}
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::set_smoothing(bool in_smoothing)
+	{
+		// false keeps the discrete quantile descent, true inverts the kernel
+		// smoothed conditional cdf of every layer with the bandwidth set
+		smoothing = in_smoothing;
+	}
 
 	template <typename T, typename U>
 	void ImplicitTrieKQuantile<T, U>::transform(const std::vector<U>& in01, std::vector<U>& out/*, const U lambda*/) const
 	{
+		if(smoothing && bandwidth.size() != in01.size())
+			throw std::logic_error("bandwidth.size() != in01.size()");
 		auto p = sample->root;
 		for(size_t i = 0, k; i != in01.size(); i++)
 		{
-//        out[i] = kquantile_transform(p, i, in01[i], bandwidth[i], lambda);
-//        k = quantile_transform(p, i, in01[i]).first;
-			std::tie(k, out[i]) = quantile_transform(p, i, in01[i]);
-
-//        k = 0;
-//        U min_distance = std::abs(out[i] - grids[i][p->children.front()->index] + dx[i]);
-//        for(size_t j = 1; j < p->children.size(); j++)
-//        {
-//            U temp = std::abs(out[i] - grids[i][p->children[j]->index] + dx[i]);
-//            if(temp < min_distance)
-//            {
-//                k = j;
-//                min_distance = temp;
-//            }
-//        }
+			if(!smoothing)
+			{
+				std::tie(k, out[i]) = quantile_transform(p, i, in01[i]);
+				p = p->children[k];
+				continue;
+			}
+			// the smoothed value may fall between the occupied cells, the descent
+			// continues through the child with the nearest cell centre
+			out[i] = kquantile_transform(p, i, in01[i], bandwidth[i], 1.0);
+			k = 0;
+			U min_distance = std::abs(out[i] - (grids[i][p->children.front()->index] + dx[i]));
+			for(size_t j = 1; j < p->children.size(); j++)
+			{
+				U temp = std::abs(out[i] - (grids[i][p->children[j]->index] + dx[i]));
+				if(temp < min_distance)
+				{
+					k = j;
+					min_distance = temp;
+				}
+			}
 			p = p->children[k];
 		}
 	}
@@ -461,129 +386,260 @@ namespace mveqf
 //	}
 
 	template <typename T, typename U>
-	U ImplicitTrieKQuantile<T, U>::kquantile_transform(NodeCount<T> *layer, size_t ind, U val01, U in_bandwidth, const U lambda) const
+	std::vector<std::pair<NodeCount<T>*, size_t>> ImplicitTrieKQuantile<T, U>::get_inner_nodes() const
 	{
+		// nodes with children in pre-order together with their depth, the order
+		// identifies a node in a saved table
+		std::vector<std::pair<NodeCount<T>*, size_t>> res;
+		std::vector<std::pair<NodeCount<T>*, size_t>> stack = {{sample->root, 0}};
+		while(!stack.empty())
+		{
+			auto p = stack.back();
+			stack.pop_back();
+			if(p.first->children.empty() || p.second >= grid_number.size())
+				continue;
+			res.push_back(p);
+			for(size_t i = p.first->children.size(); i != 0; i--)
+				stack.emplace_back(p.first->children[i - 1], p.second + 1);
+		}
+		return res;
+	}
 
-//    timer::Timer time;
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::precompute_cdf_tables(size_t min_count, const U lambda, size_t table_size)
+	{
+		if(bandwidth.size() != grid_number.size())
+			throw std::logic_error("bandwidth.size() != dimension");
+		if(table_size < 1)
+			throw std::logic_error("table_size < 1");
+		// a table costs table_size + 1 cdf evaluations against about twenty for a
+		// direct inversion, so nodes with few points are left to the direct path
+		std::vector<std::pair<NodeCount<T>*, size_t>> nodes;
+		for(const auto &p : get_inner_nodes())
+		{
+			if(p.first->count >= min_count)
+				nodes.push_back(p);
+		}
+
+		// the workers take the next node from a shared counter, so a thread that
+		// finishes its small tables moves on to whatever is left
+		std::vector<std::shared_ptr<const CdfTable>> tables(nodes.size());
+		std::atomic<size_t> next(0);
+		const size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), nodes.size()));
+		std::vector<std::future<void>> futures;
+		for(size_t i = 0; i != nthreads; i++)
+		{
+			futures.emplace_back(std::async(std::launch::async, [&]()
+			{
+				for(size_t k = next++; k < nodes.size(); k = next++)
+					tables[k] = build_cdf_table(nodes[k].first, nodes[k].second, bandwidth[nodes[k].second], lambda, table_size);
+			}));
+		}
+		for(auto &i : futures)
+			i.get();
+		for(size_t i = 0; i != nodes.size(); i++)
+			cdf_tables[nodes[i].first] = tables[i];
+	}
 
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::save_cdf_tables(std::ostream &out) const
+	{
+		// one line per table: node position in pre-order, bandwidth, lambda, size, values
+		const auto nodes = get_inner_nodes();
+		const auto precision = out.precision(std::numeric_limits<U>::max_digits10);
+		out << cdf_tables.size() << '\n';
+		for(size_t i = 0; i != nodes.size(); i++)
+		{
+			auto it = cdf_tables.find(nodes[i].first);
+			if(it == cdf_tables.end())
+				continue;
+			const auto &table = *it->second;
+			out << i << ' ' << table.bandwidth << ' ' << table.lambda << ' ' << table.cdf.size();
+			for(const auto &v : table.cdf)
+				out << ' ' << v;
+			out << '\n';
+		}
+		out.precision(precision);
+	}
 
+	template <typename T, typename U>
+	void ImplicitTrieKQuantile<T, U>::load_cdf_tables(std::istream &in)
+	{
+		const auto nodes = get_inner_nodes();
+		size_t n = 0;
+		if(!(in >> n))
+			throw std::logic_error("cdf tables: bad header");
+		std::unordered_map<const NodeCount<T>*, std::shared_ptr<const CdfTable>> res;
+		for(size_t i = 0; i != n; i++)
+		{
+			size_t position = 0, size = 0;
+			auto table = std::make_shared<CdfTable>();
+			if(!(in >> position >> table->bandwidth >> table->lambda >> size) || position >= nodes.size() || size < 2)
+				throw std::logic_error("cdf tables do not match the sample");
+			table->cdf.resize(size);
+			for(auto &v : table->cdf)
+			{
+				if(!(in >> v))
+					throw std::logic_error("cdf tables: truncated");
+			}
+			res[nodes[position].first] = table;
+		}
+		cdf_tables = std::move(res);
+	}
+
+	template <typename T, typename U>
+	std::shared_ptr<const typename ImplicitTrieKQuantile<T, U>::CdfTable> ImplicitTrieKQuantile<T, U>::build_cdf_table(NodeCount<T> *layer, size_t ind, U in_bandwidth, const U lambda, size_t table_size) const
+	{
 		kquantile::Qkde<T, U> obj;
 		obj.set_kernel_type(kernel_type);
+		obj.set_kernel_table(kernel_table);
 		obj.set_sample(layer, ind, grids, dx, in_bandwidth, lambda);
 
-//    std::cout << std::fixed << '\t' << time.elapsed_seconds() << std::endl;
-//    time.reset();
-
+		auto table = std::make_shared<CdfTable>();
+		table->bandwidth = in_bandwidth;
+		table->lambda = lambda;
+		table->cdf.resize(table_size + 1);
 		const U lower_bound = grids[ind].front();
-		const U upper_bound = grids[ind].back();
-
-		const U es = upper_bound - lower_bound;
-		const U min = obj.cdf(lower_bound,/* layer, ind, grids, dx,*/ lambda);
-		const U max = obj.cdf(upper_bound,/* layer, ind, grids, dx,*/ lambda);
-
-		const size_t n = 100000;
-		size_t c = n - 1, step;
-		U f1, f2, p1, p2;
-		size_t f = 0, i = 0;
-		while(c > 0)
+		const U es = grids[ind].back() - lower_bound;
+		for(size_t i = 0; i <= table_size; i++)
+			table->cdf[i] = obj.cdf(lower_bound + es*i/table_size, lambda);
+		const U min = table->cdf.front();
+		const U max = table->cdf.back();
+		for(size_t i = 0; i <= table_size; i++)
 		{
-			i = f;
-			step = c / 2;
-			i = i + step;
+			// a degenerate cdf is replaced by the uniform one
+			U t = max > min ? (table->cdf[i] - min)/(max - min) : U(i)/table_size;
+			t = std::isfinite(t) ? std::min(U(1.0), std::max(U(0.0), t)) : U(i)/table_size;
+			table->cdf[i] = i > 0 ? std::max(t, table->cdf[i - 1]) : t;
+		}
+		return table;
+	}
 
-			p1 = lower_bound + es * i / (n - 1);
-			f1 = (obj.cdf(p1, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
-			if(f1 < val01)
+	template <typename T, typename U>
+	std::shared_ptr<const typename ImplicitTrieKQuantile<T, U>::CdfTable> ImplicitTrieKQuantile<T, U>::get_cdf_table(NodeCount<T> *layer, size_t ind, U in_bandwidth, const U lambda) const
+	{
+		auto eager = cdf_tables.find(layer);
+		if(eager != cdf_tables.end() && eager->second->bandwidth == in_bandwidth && eager->second->lambda == lambda)
+			return eager->second;
+		if(cdf_cache_budget == 0)
+			return nullptr;
+		{
+			std::lock_guard<std::mutex> lock(cdf_mutex);
+			auto it = cdf_cache.find(layer);
+			if(it != cdf_cache.end() && it->second->second->bandwidth == in_bandwidth && it->second->second->lambda == lambda)
 			{
-				++i;
-				f = i;
-				c -= step + 1;
+				cdf_order.splice(cdf_order.begin(), cdf_order, it->second);
+				return it->second->second;
 			}
-			else
-				c = step;
 		}
 
-		p2 = lower_bound + es * (i + 1) / (n - 1);
-		f2 = (obj.cdf(p2, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
+		// built outside the lock, a table computed twice by racing threads is the same
+		auto table = build_cdf_table(layer, ind, in_bandwidth, lambda, cdf_table_size);
 
-		U check = p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-		if(!std::isfinite(check))
+		const size_t bytes = sizeof(CdfTable) + table->cdf.size()*sizeof(U);
+		std::lock_guard<std::mutex> lock(cdf_mutex);
+		auto it = cdf_cache.find(layer);
+		if(it != cdf_cache.end())
 		{
-			size_t max_ind = 0;
-			for(size_t j = 0; j != n - 1; j++)
-			{
-				p2 = lower_bound + es * (j + 1) / (n - 1);
-				f2 = (obj.cdf(p2, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
-				if(f2 < 1.0)
-					max_ind = j;
-				if(f2 > val01)
-				{
-					p1 = lower_bound + es * j / (n - 1);
-					f1 = (obj.cdf(p1, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
-					return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-				}
-			}
-			std::cout << "fff" << std::endl;// std::fixed << '\t' << time.elapsed_seconds() << std::endl;
-//
-//        for(size_t j = 0; j != layer->children.size(); j++)
-//        {
-//            std::cout << layer->children[i]->count << std::endl;
-//        }
-//
-
-//        std::cin.get();
-			return lower_bound + es * max_ind / (n - 1);
+			cdf_cache_bytes -= sizeof(CdfTable) + it->second->second->cdf.size()*sizeof(U);
+			cdf_order.erase(it->second);
+			cdf_cache.erase(it);
 		}
-		if(!std::isnormal(check))
+		while(!cdf_order.empty() && cdf_cache_bytes + bytes > cdf_cache_budget)
 		{
-//        std::cout << check << std::endl;
-
-//        std::cout.precision(20);
-//        std::cout << std::scientific << std::numeric_limits<float>::denorm_min() << std::endl;
-//        std::cout << std::scientific << std::numeric_limits<float>::lowest() << std::endl;
-//        std::cout << std::scientific << p1 << " + (" << val01 << " - " << f1 << " )*( " << p2 << " - " << p1 << " )/( " << f2 << " - " << f1 << " ) " << std::endl;
-//        std::cout << "fff" << std::endl;
-
-//        U t1 = (val01 - f1)*(p2 - p1);
-//        U t2 = t1/(f2 - f1);
-//        U check = p1 + t2;
-//        if(!std::isnormal(check))
-//            std::cout << "ff" << std::endl;
-
+			cdf_cache_bytes -= sizeof(CdfTable) + cdf_order.back().second->cdf.size()*sizeof(U);
+			cdf_cache.erase(cdf_order.back().first);
+			cdf_order.pop_back();
+		}
+		if(bytes <= cdf_cache_budget)
+		{
+			cdf_order.emplace_front(layer, table);
+			cdf_cache[layer] = cdf_order.begin();
+			cdf_cache_bytes += bytes;
+		}
+		return table;
+	}
 
+	template <typename T, typename U>
+	U ImplicitTrieKQuantile<T, U>::kquantile_transform(NodeCount<T> *layer, size_t ind, U val01, U in_bandwidth, const U lambda) const
+	{
+		// inverse of a precomputed or cached table by bisection and linear interpolation
+		if(const auto table = get_cdf_table(layer, ind, in_bandwidth, lambda))
+		{
+			const auto &cdf = table->cdf;
+			const U lower_bound = grids[ind].front();
+			const U es = grids[ind].back() - lower_bound;
+			auto it = std::lower_bound(cdf.begin(), cdf.end(), val01);
+			if(it == cdf.begin())
+				return lower_bound;
+			if(it == cdf.end())
+				return grids[ind].back();
+			const size_t i = std::distance(cdf.begin(), it) - 1;
+			const U f1 = cdf[i], f2 = cdf[i + 1];
+			const U t = f2 > f1 ? (val01 - f1)/(f2 - f1) : 0.5;
+			return lower_bound + es*(i + t)/(cdf.size() - 1);
+		}
 
+		kquantile::Qkde<T, U> obj;
+		obj.set_kernel_type(kernel_type);
+		obj.set_kernel_table(kernel_table);
+		obj.set_sample(layer, ind, grids, dx, in_bandwidth, lambda);
 
-			size_t max_ind = 0;
-			for(size_t j = 0; j != n - 1; j++)
-			{
-				p2 = lower_bound + es * (j + 1) / (n - 1);
-				f2 = (obj.cdf(p2, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
-				if(f2 < 1.0)
-					max_ind = j;
-				if(f2 > val01)
-				{
-					p1 = lower_bound + es * j / (n - 1);
-					f1 = (obj.cdf(p1, /*layer, ind, grids, dx,*/ lambda) - min)/(max - min);
-					return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
-				}
-			}
-			check = lower_bound + es * max_ind / (n - 1);
-			if(std::isnormal(check))
+		// the grid nodes bracket the root of (cdf(x) - cdf(lb))/(cdf(ub) - cdf(lb)) = val01,
+		// inside the bracket Newton steps take the mixture pdf as derivative and a
+		// step leaving the bracket or longer than half the previous one is replaced
+		// by bisection
+		const auto &grid = grids[ind];
+		const U min = obj.cdf(grid.front(), lambda);
+		const U max = obj.cdf(grid.back(), lambda);
+		if(!(max > min) || !(val01 > 0.0))
+			return grid.front();
+		if(!(val01 < 1.0))
+			return grid.back();
+		const U scale = max - min;
+
+		size_t first = 0, last = grid.size() - 1;
+		U g_first = -val01, g_last = 1.0 - val01;
+		while(last - first > 1)
+		{
+			const size_t middle = first + (last - first)/2;
+			const U g = (obj.cdf(grid[middle], lambda) - min)/scale - val01;
+			if(g < 0.0)
 			{
-				return check;
+				first = middle;
+				g_first = g;
 			}
 			else
 			{
-				if(max_ind > 0)
-					return lower_bound + es * (max_ind - 1) / (n - 1);
-				else
-					return lower_bound + es * (max_ind + 1) / (n - 1);
+				last = middle;
+				g_last = g;
 			}
 		}
 
-//    std::cout << std::fixed << '\t' << time.elapsed_seconds() << std::endl;
-
-		return p1 + (val01 - f1)*(p2 - p1)/(f2 - f1);
+		U lower_bound = grid[first];
+		U upper_bound = grid[last];
+		const U tolerance = 4.0*std::numeric_limits<U>::epsilon()*std::max(std::abs(lower_bound) + std::abs(upper_bound), grid.back() - grid.front());
+		U x = lower_bound - g_first*(upper_bound - lower_bound)/(g_last - g_first);
+		U last_step = upper_bound - lower_bound;
+		for(size_t i = 0; i != 100 && upper_bound - lower_bound > tolerance; i++)
+		{
+			const U g = (obj.cdf(x, lambda) - min)/scale - val01;
+			if(g == 0.0)
+				return x;
+			if(g < 0.0)
+				lower_bound = x;
+			else
+				upper_bound = x;
+
+			U next = x - g*scale/obj.pdf(x, lambda);
+			if(!(next > lower_bound && next < upper_bound) || 2.0*std::abs(next - x) > last_step)
+				next = 0.5*(lower_bound + upper_bound);
+			if(std::abs(next - x) <= tolerance)
+				return next;
+			last_step = std::abs(next - x);
+			x = next;
+		}
+		return x;
 	}
 
 	template <typename T, typename U>
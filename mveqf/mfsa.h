@@ -19,11 +19,21 @@
 #define MFSA_H
 
 #include <memory>
+#include <map>
 #include <set>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <future>
+#include <thread>
 #include <mveqf/cstvect.h>
 #include <mveqf/sample.h>
+#include <mveqf/trie_node.h>
+#include <mveqf/trie_based.h>
 
 namespace mveqf
 {
@@ -33,11 +43,12 @@ namespace mveqf
 		struct Node
 		{
 			bool accepting_state;
+			size_t weight;
 			size_t count;
 			size_t in_count;
 			cst::vector<std::pair<TIndex, std::shared_ptr<Node<TIndex>>>> children;
 
-			Node<TIndex>(bool accept);
+			Node<TIndex>(bool accept, size_t w = 1);
 			Node<TIndex>(const Node<TIndex> *p);
 			Node<TIndex> *transition(TIndex label) const;
 			std::shared_ptr<Node<TIndex>> transition_shared(TIndex label) const;
@@ -48,10 +59,10 @@ namespace mveqf
 		};
 
 		template <typename TIndex>
-		Node<TIndex>::Node(bool accept): accepting_state(accept), count(0), in_count(0) {}
+		Node<TIndex>::Node(bool accept, size_t w): accepting_state(accept), weight(w), count(0), in_count(0) {}
 
 		template <typename TIndex>
-		Node<TIndex>::Node(const Node<TIndex> *p): accepting_state(p->accepting_state), count(0), in_count(0), children(p->children)
+		Node<TIndex>::Node(const Node<TIndex> *p): accepting_state(p->accepting_state), weight(p->weight), count(0), in_count(0), children(p->children)
 		{
 			for(const auto &i : children)
 				i.second->in_count++;
@@ -150,10 +161,59 @@ namespace mveqf
 		{
 			bool equal = this == obj;
 			if(!equal && obj != nullptr)
-				equal = accepting_state == obj->accepting_state && same_path(obj);
+				equal = accepting_state == obj->accepting_state && weight == obj->weight && same_path(obj);
 			return equal;
 		}
 
+		// state signature for the register: children of a registered state are
+		// registered themselves, so two states are equivalent iff they have the same
+		// accepting flag, weight and (label, child) pairs
+		template <typename TIndex>
+		struct Signature
+		{
+			bool accepting_state;
+			size_t weight;
+			std::vector<std::pair<TIndex, const Node<TIndex>*>> children;
+
+			explicit Signature(const Node<TIndex> *p);
+			bool operator==(const Signature<TIndex> &other) const;
+		};
+
+		template <typename TIndex>
+		Signature<TIndex>::Signature(const Node<TIndex> *p): accepting_state(p->accepting_state), weight(p->weight)
+		{
+			children.reserve(p->children.size());
+			for(const auto &i : p->children)
+				children.emplace_back(i.first, i.second.get());
+			std::sort(children.begin(), children.end(), [](const auto &l, const auto &r)
+			{
+				return l.first < r.first;
+			});
+		}
+
+		template <typename TIndex>
+		bool Signature<TIndex>::operator==(const Signature<TIndex> &other) const
+		{
+			return accepting_state == other.accepting_state && weight == other.weight && children == other.children;
+		}
+
+		template <typename TIndex>
+		class SignatureHasher
+		{
+		public:
+			size_t operator()(const Signature<TIndex> &key) const
+			{
+				std::size_t seed = key.children.size() + key.accepting_state;
+				seed ^= key.weight + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+				for(const auto &i : key.children)
+				{
+					seed ^= static_cast<size_t>(i.first) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+					seed ^= std::hash<const Node<TIndex>*>()(i.second) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+				}
+				return seed;
+			}
+		};
+
 		// virtual void insert(const std::vector<TIndex> &key) = 0;
 		// virtual void insert(const std::vector<TIndex> &key, size_t number) = 0;
 		// virtual bool search(const std::vector<TIndex> &key) const = 0;
@@ -173,8 +233,10 @@ namespace mveqf
 			size_t get_dimension() const override;
 			void insert(const std::vector<TIndex> &key) override;
 			void insert(const std::vector<TIndex> &key, size_t number) override;
+			void insert_sorted(const std::vector<std::vector<TIndex>> &keys);
 			bool search(const std::vector<TIndex> &key) const override;
 			void fill_tree_count() override;
+			size_t get_revision() const;
 
 			std::pair<size_t, size_t> get_node_link_count() const;
 
@@ -182,18 +244,26 @@ namespace mveqf
 			size_t get_link_count() const override;
 		protected:
 			size_t dimension;
-			std::vector<std::pair<std::shared_ptr<Node<TIndex>>, std::shared_ptr<Node<TIndex>>>> eq;
+			// changes whenever states or counts change, lets users of the automaton
+			// tell when data derived from it is out of date
+			size_t revision;
+			std::unordered_map<Signature<TIndex>, std::shared_ptr<Node<TIndex>>, SignatureHasher<TIndex>> eq;
+			// final states of weighted keys, the last edge of a key leads to the final
+			// state of its multiplicity
+			std::map<size_t, std::shared_ptr<Node<TIndex>>> weighted_final;
 
+			std::shared_ptr<Node<TIndex>> get_final_state(size_t weight);
 			size_t count_nodes(Node<TIndex> *current, std::set<std::shared_ptr<Node<TIndex>>> &data) const;
-			void fill_tree_count(Node<TIndex> *p);
-			void get_number(Node<TIndex> *p, size_t &count) const;
+			void fill_tree_count(Node<TIndex> *p, std::unordered_set<Node<TIndex>*> &visited);
 			void get_link(Node<TIndex>* p, size_t &count) const;
 			std::vector<TIndex> longest_prefix(const std::vector<TIndex> &key) const;
 			void replace_or_register(const std::shared_ptr<Node<TIndex>> &p, const std::vector<TIndex> &key);
 			void add_path(Node<TIndex> *p, const std::vector<TIndex> &key);
+			void add_path(Node<TIndex> *p, const std::vector<TIndex> &key, const std::shared_ptr<Node<TIndex>> &final);
 			void remove_path(const std::vector<TIndex> &key);
 			void clone_path(Node<TIndex> *pivot, const std::vector<TIndex> &to_pivot, const std::vector<TIndex> &key) const;
 			void add(const std::vector<TIndex> &key);
+			void add(const std::vector<TIndex> &key, const std::shared_ptr<Node<TIndex>> &final);
 		};
 
 		template <typename TIndex>
@@ -211,50 +281,112 @@ namespace mveqf
 		template <typename TIndex>
 		void MFSA<TIndex>::fill_tree_count()
 		{
-			fill_tree_count(root.get());
+			std::unordered_set<Node<TIndex>*> visited;
+			fill_tree_count(root.get(), visited);
 			size_t count = 0;
 			for(const auto &i : root->children)
 				count += i.second->count;
 			root->count = count;
+			++revision;
 		}
 
 		template <typename TIndex>
-		void MFSA<TIndex>::fill_tree_count(Node<TIndex> *p)
+		size_t MFSA<TIndex>::get_revision() const
 		{
-			for(const auto &i : p->children)
-			{
-				size_t count = 0;
-				get_number(i.second.get(), count);
-				i.second->count = count > 0 ? count : 1;
-				fill_tree_count(i.second.get());
-			}
+			return revision;
 		}
 
 		template <typename TIndex>
-		void MFSA<TIndex>::get_number(Node<TIndex> *p, size_t &count) const
+		void MFSA<TIndex>::fill_tree_count(Node<TIndex> *p, std::unordered_set<Node<TIndex>*> &visited)
 		{
+			// shared states are counted once, children before their parents
 			for(const auto &i : p->children)
 			{
-				if(i.second->children.empty())
-					++count;
-				get_number(i.second.get(), count);
+				Node<TIndex> *c = i.second.get();
+				if(!visited.insert(c).second)
+					continue;
+				fill_tree_count(c, visited);
+				size_t count = 0;
+				for(const auto &j : c->children)
+					count += j.second->count;
+				c->count = count > 0 ? count : c->weight;
 			}
 		}
 
 		template <typename TIndex>
-		MFSA<TIndex>::MFSA() : root(std::make_shared<Node<TIndex>>(false)), final_state(std::make_shared<Node<TIndex>>(true)), dimension(0) {}
+		MFSA<TIndex>::MFSA() : root(std::make_shared<Node<TIndex>>(false)), final_state(std::make_shared<Node<TIndex>>(true)), dimension(0), revision(0) {}
 
 		template <typename TIndex>
 		void MFSA<TIndex>::insert(const std::vector<TIndex> &key)
 		{
 			add(key);
 			replace_or_register(root, key);
+			++revision;
 		}
 
 		template <typename TIndex>
 		void MFSA<TIndex>::insert(const std::vector<TIndex> &key, size_t number)
 		{
-			insert(key);
+			// multiplicities of repeated keys are accumulated
+			if(key.empty())
+			{
+				insert(key);
+				return;
+			}
+			Node<TIndex> *p = root->transition(key);
+			size_t weight = number + (p != nullptr && p->accepting_state ? p->weight : 0);
+			add(key, get_final_state(weight));
+			replace_or_register(root, key);
+			++revision;
+		}
+
+		template <typename TIndex>
+		std::shared_ptr<Node<TIndex>> MFSA<TIndex>::get_final_state(size_t weight)
+		{
+			if(weight == final_state->weight)
+				return final_state;
+			auto it = weighted_final.find(weight);
+			if(it == weighted_final.end())
+				it = weighted_final.emplace(weight, std::make_shared<Node<TIndex>>(true, weight)).first;
+			return it->second;
+		}
+
+		template <typename TIndex>
+		void MFSA<TIndex>::insert_sorted(const std::vector<std::vector<TIndex>> &keys)
+		{
+			// incremental construction for lexicographically sorted keys: the previous key
+			// path is minimised only below the point where the next key diverges, no path
+			// is ever cloned or removed from the register
+			if(!root->children.empty())
+				throw std::logic_error("insert_sorted requires an empty automaton");
+
+			const std::vector<TIndex> *previous = nullptr;
+			for(const auto &key : keys)
+			{
+				size_t prefix = 0;
+				if(previous != nullptr)
+				{
+					if(key < *previous)
+						throw std::logic_error("insert_sorted requires sorted keys");
+					if(key == *previous)
+						continue;
+					while(prefix < key.size() && prefix < previous->size() && key[prefix] == (*previous)[prefix])
+						++prefix;
+				}
+
+				std::shared_ptr<Node<TIndex>> last_state = root;
+				for(size_t i = 0; i != prefix; i++)
+					last_state = last_state->transition_shared(key[i]);
+
+				if(previous != nullptr && prefix < previous->size())
+					replace_or_register(last_state, std::vector<TIndex>(previous->begin() + prefix, previous->end()));
+
+				add_path(last_state.get(), std::vector<TIndex>(key.begin() + prefix, key.end()));
+				previous = &key;
+			}
+			if(previous != nullptr && !previous->empty())
+				replace_or_register(root, *previous);
+			++revision;
 		}
 
 		template <typename TIndex>
@@ -286,21 +418,15 @@ namespace mveqf
 			if(t->children.size() > 0 && subvect.size() > 0)
 				replace_or_register(t, subvect);
 
-			std::shared_ptr<Node<TIndex>> en = nullptr;
-			for(size_t j = 0; j != eq.size(); j++)
-			{
-				if(eq[j].first->is_equal(t.get()))
-				{
-					en = eq[j].second;
-					break;
-				}
-			}
-			if(en == nullptr)
+			Signature<TIndex> signature(t.get());
+			auto found = eq.find(signature);
+			if(found == eq.end())
 			{
-				eq.push_back(std::make_pair(t, t));
+				eq.emplace(std::move(signature), t);
 			}
-			else if(en != t)
+			else if(found->second != t)
 			{
+				std::shared_ptr<Node<TIndex>> en = found->second;
 				for(const auto &i : t->children)
 					i.second->in_count--;
 
@@ -323,6 +449,12 @@ namespace mveqf
 
 		template <typename TIndex>
 		void MFSA<TIndex>::add_path(Node<TIndex> *p, const std::vector<TIndex> &key)
+		{
+			add_path(p, key, final_state);
+		}
+
+		template <typename TIndex>
+		void MFSA<TIndex>::add_path(Node<TIndex> *p, const std::vector<TIndex> &key, const std::shared_ptr<Node<TIndex>> &final)
 		{
 			if(key.size() > 0)
 			{
@@ -332,7 +464,7 @@ namespace mveqf
 					current = current->add_node(key[i]);
 				}
 
-				std::shared_ptr<Node<TIndex>> p = final_state;
+				std::shared_ptr<Node<TIndex>> p = final;
 				p->in_count++;
 				TIndex label = key.back();
 				auto it = std::find_if(current->children.begin(), current->children.end(),
@@ -361,14 +493,9 @@ namespace mveqf
 			for(const auto &i : key)
 			{
 				current = current->transition(i);
-				for(size_t j = 0; j != eq.size(); j++)
-				{
-					if(eq[j].first->is_equal(current) && eq[j].second->is_equal(current))
-					{
-						eq.erase(eq.begin() + j);
-						break;
-					}
-				}
+				auto it = eq.find(Signature<TIndex>(current));
+				if(it != eq.end() && it->second.get() == current)
+					eq.erase(it);
 			}
 		}
 
@@ -439,6 +566,12 @@ namespace mveqf
 
 		template <typename TIndex>
 		void MFSA<TIndex>::add(const std::vector<TIndex> &key)
+		{
+			add(key, final_state);
+		}
+
+		template <typename TIndex>
+		void MFSA<TIndex>::add(const std::vector<TIndex> &key, const std::shared_ptr<Node<TIndex>> &final)
 		{
 			std::vector<TIndex> prefix = longest_prefix(key);
 			std::vector<TIndex> suffix(key.begin() + prefix.size(), key.begin() + key.size());
@@ -475,7 +608,23 @@ namespace mveqf
 					clone_path(current, key_to_first, duplicate);
 				}
 			}
-			add_path(root->transition(prefix), suffix);
+			if(suffix.empty() && final != final_state)
+			{
+				// the key is already present, its path is private now: redirect the last edge
+				Node<TIndex> *parent = root->transition(std::vector<TIndex>(key.begin(), key.end() - 1));
+				for(auto &i : parent->children)
+				{
+					if(i.first == key.back())
+					{
+						i.second->in_count--;
+						i.second = final;
+						final->in_count++;
+						break;
+					}
+				}
+				return;
+			}
+			add_path(root->transition(prefix), suffix, final);
 		}
 
 		template <typename TIndex>
@@ -534,6 +683,457 @@ namespace mveqf
 			for(const auto &i: p->children)
 				get_link(i.second.get(), count);
 		}
+
+		// MFSA with states in a contiguous arena: a state owns a contiguous range of
+		// edges sorted by label, an edge is a label and the 32-bit id of its target state. States are
+		// appended only once they are minimal, so a child always has a smaller id than
+		// its parents. Keys must be inserted in lexicographic order, a key inserted with
+		// a number carries that multiplicity, the automaton is finalised by
+		// fill_tree_count(). Alternatively build() converts a finished
+		// TrieBased, keeping its counts: subtrees are only merged if their counts agree.
+		template <typename TIndex>
+		class ArenaMFSA : public Sample<TIndex>
+		{
+		public:
+			typedef std::uint32_t state_id;
+
+			struct Edge
+			{
+				TIndex label;
+				state_id target;
+			};
+
+			struct State
+			{
+				state_id first;
+				state_id size;
+				bool accepting_state;
+				size_t count;
+			};
+
+			ArenaMFSA();
+			ArenaMFSA(const ArenaMFSA&) = delete;
+			ArenaMFSA& operator=(const ArenaMFSA&) = delete;
+			void set_dimension(size_t dim) override;
+			size_t get_dimension() const override;
+			void insert(const std::vector<TIndex> &key) override;
+			void insert(const std::vector<TIndex> &key, size_t number) override;
+			bool search(const std::vector<TIndex> &key) const override;
+			void fill_tree_count() override;
+			void build(const TrieBased<NodeCount<TIndex>, TIndex> &trie);
+
+			bool is_finalized() const;
+			state_id get_root() const;
+			const State &get_state(state_id id) const;
+			const Edge &get_edge(state_id id, size_t k) const;
+			const Edge *get_edges(state_id id) const;
+			size_t get_mass(state_id id, size_t k) const;
+
+			size_t get_node_count() const override;
+			size_t get_link_count() const override;
+		protected:
+			static constexpr state_id pending = std::numeric_limits<state_id>::max();
+
+			// states of the last inserted key which are not minimised yet,
+			// the last edge of path[i] leads to path[i + 1]
+			struct PendingState
+			{
+				bool accepting_state = false;
+				size_t count = 0;
+				std::vector<Edge> edges;
+			};
+
+			class StateHasher
+			{
+			public:
+				const ArenaMFSA<TIndex> *arena;
+				size_t operator()(state_id id) const
+				{
+					const State &s = arena->states[id];
+					std::size_t seed = s.size + s.accepting_state;
+					seed ^= s.count + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+					for(state_id i = s.first; i != s.first + s.size; i++)
+					{
+						seed ^= static_cast<size_t>(arena->edges[i].label) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+						seed ^= static_cast<size_t>(arena->edges[i].target) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+					}
+					return seed;
+				}
+			};
+
+			class StateEqual
+			{
+			public:
+				const ArenaMFSA<TIndex> *arena;
+				bool operator()(state_id l, state_id r) const
+				{
+					const State &a = arena->states[l];
+					const State &b = arena->states[r];
+					if(a.accepting_state != b.accepting_state || a.size != b.size || a.count != b.count)
+						return false;
+					for(state_id i = 0; i != a.size; i++)
+					{
+						const Edge &x = arena->edges[a.first + i];
+						const Edge &y = arena->edges[b.first + i];
+						if(x.label != y.label || x.target != y.target)
+							return false;
+					}
+					return true;
+				}
+			};
+
+			size_t dimension;
+			bool finalized;
+			bool counted;
+			state_id root;
+			std::vector<State> states;
+			std::vector<Edge> edges;
+			std::vector<PendingState> path;
+			std::vector<TIndex> last_key;
+			std::unordered_set<state_id, StateHasher, StateEqual> eq;
+			// mass[i] is the count below the edges of its state up to and including
+			// edge i, filled once the counts are final
+			std::vector<size_t> mass;
+
+			state_id replace_or_register(const PendingState &p);
+			void fill_mass();
+			void minimise_path(size_t depth);
+			state_id freeze(const NodeCount<TIndex> *p);
+			state_id merge(const ArenaMFSA<TIndex> &other, state_id id, std::vector<state_id> &ids);
+		};
+
+		template <typename TIndex>
+		ArenaMFSA<TIndex>::ArenaMFSA() : dimension(0), finalized(false), counted(false), root(pending), path(1), eq(0, StateHasher{this}, StateEqual{this}) {}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::set_dimension(size_t dim)
+		{
+			dimension = dim;
+		}
+
+		template <typename TIndex>
+		size_t ArenaMFSA<TIndex>::get_dimension() const
+		{
+			return dimension;
+		}
+
+		template <typename TIndex>
+		typename ArenaMFSA<TIndex>::state_id ArenaMFSA<TIndex>::replace_or_register(const PendingState &p)
+		{
+			// the candidate is appended to the arena and rolled back if an equivalent state exists
+			if(edges.size() + p.edges.size() >= pending || states.size() + 1 >= pending)
+				throw std::length_error("ArenaMFSA state ids exhausted");
+
+			state_id id = static_cast<state_id>(states.size());
+			states.push_back(State{static_cast<state_id>(edges.size()), static_cast<state_id>(p.edges.size()), p.accepting_state, p.count});
+			edges.insert(edges.end(), p.edges.begin(), p.edges.end());
+
+			auto it = eq.find(id);
+			if(it != eq.end())
+			{
+				edges.resize(states.back().first);
+				states.pop_back();
+				return *it;
+			}
+			eq.insert(id);
+			return id;
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::minimise_path(size_t depth)
+		{
+			while(path.size() > depth + 1)
+			{
+				state_id id = replace_or_register(path.back());
+				path.pop_back();
+				path.back().edges.back().target = id;
+			}
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::insert(const std::vector<TIndex> &key)
+		{
+			if(finalized)
+				throw std::logic_error("ArenaMFSA is already finalized");
+
+			size_t prefix = 0;
+			if(path.front().accepting_state || !path.front().edges.empty())
+			{
+				if(key < last_key)
+					throw std::logic_error("ArenaMFSA requires sorted keys");
+				if(key == last_key)
+					return;
+				while(prefix < key.size() && prefix < last_key.size() && key[prefix] == last_key[prefix])
+					++prefix;
+			}
+
+			minimise_path(prefix);
+			for(size_t i = prefix; i != key.size(); i++)
+			{
+				path.back().edges.push_back(Edge{key[i], pending});
+				path.emplace_back();
+			}
+			path.back().accepting_state = true;
+			path.back().count = 1;
+			last_key = key;
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::insert(const std::vector<TIndex> &key, size_t number)
+		{
+			// the multiplicity is the count of the accepting state, a repeated key is
+			// still the last path and accumulates
+			if(finalized)
+				throw std::logic_error("ArenaMFSA is already finalized");
+			if(number == 0)
+				return;
+			if((path.front().accepting_state || !path.front().edges.empty()) && key == last_key)
+			{
+				path.back().count += number;
+				return;
+			}
+			insert(key);
+			path.back().count = number;
+		}
+
+		template <typename TIndex>
+		bool ArenaMFSA<TIndex>::search(const std::vector<TIndex> &key) const
+		{
+			size_t depth = 0;
+			bool in_path = !finalized;
+			state_id id = root;
+			for(const auto &i : key)
+			{
+				if(in_path)
+				{
+					const auto &e = path[depth].edges;
+					auto it = std::find_if(e.begin(), e.end(), [&i](const Edge &obj)
+					{
+						return obj.label == i;
+					});
+					if(it == e.end())
+						return false;
+					if(it->target == pending)
+						++depth;
+					else
+					{
+						id = it->target;
+						in_path = false;
+					}
+				}
+				else
+				{
+					const State &s = states[id];
+					auto first = edges.begin() + s.first;
+					auto it = std::find_if(first, first + s.size, [&i](const Edge &obj)
+					{
+						return obj.label == i;
+					});
+					if(it == first + s.size)
+						return false;
+					id = it->target;
+				}
+			}
+			return in_path ? path[depth].accepting_state : states[id].accepting_state;
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::fill_tree_count()
+		{
+			if(!finalized)
+			{
+				minimise_path(0);
+				root = replace_or_register(path.front());
+				path.clear();
+				path.shrink_to_fit();
+				last_key.clear();
+				// no state is registered after this, and the counts below change
+				// states already hashed
+				decltype(eq)(0, StateHasher{this}, StateEqual{this}).swap(eq);
+				finalized = true;
+			}
+			if(counted)
+				return;
+			counted = true;
+			// children always precede their parents in the arena
+			for(auto &s : states)
+			{
+				size_t count = 0;
+				for(state_id i = s.first; i != s.first + s.size; i++)
+					count += states[edges[i].target].count;
+				s.count = s.size > 0 ? count : std::max<size_t>(s.count, 1);
+			}
+			fill_mass();
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::fill_mass()
+		{
+			mass.resize(edges.size());
+			for(const auto &s : states)
+			{
+				size_t count = 0;
+				for(state_id i = s.first; i != s.first + s.size; i++)
+				{
+					count += states[edges[i].target].count;
+					mass[i] = count;
+				}
+			}
+		}
+
+		template <typename TIndex>
+		typename ArenaMFSA<TIndex>::state_id ArenaMFSA<TIndex>::freeze(const NodeCount<TIndex> *p)
+		{
+			PendingState t;
+			t.accepting_state = p->children.empty();
+			t.count = p->count;
+			t.edges.reserve(p->children.size());
+			for(const auto &i : p->children)
+				t.edges.push_back(Edge{i->index, freeze(i)});
+			std::sort(t.edges.begin(), t.edges.end(), [](const Edge &l, const Edge &r)
+			{
+				return l.label < r.label;
+			});
+			return replace_or_register(t);
+		}
+
+		template <typename TIndex>
+		typename ArenaMFSA<TIndex>::state_id ArenaMFSA<TIndex>::merge(const ArenaMFSA<TIndex> &other, state_id id, std::vector<state_id> &ids)
+		{
+			if(ids[id] != pending)
+				return ids[id];
+			const State &s = other.states[id];
+			PendingState t;
+			t.accepting_state = s.accepting_state;
+			t.count = s.count;
+			t.edges.reserve(s.size);
+			for(state_id i = s.first; i != s.first + s.size; i++)
+				t.edges.push_back(Edge{other.edges[i].label, merge(other, other.edges[i].target, ids)});
+			ids[id] = replace_or_register(t);
+			return ids[id];
+		}
+
+		template <typename TIndex>
+		void ArenaMFSA<TIndex>::build(const TrieBased<NodeCount<TIndex>, TIndex> &trie)
+		{
+			if(finalized || !path.front().edges.empty() || path.front().accepting_state)
+				throw std::logic_error("ArenaMFSA::build requires an empty automaton");
+			// the counts are copied, an uncounted trie would leave them all zero
+			if(!trie.root->children.empty() && trie.root->count == 0)
+				throw std::logic_error("ArenaMFSA::build requires a counted trie, call fill_tree_count first");
+
+			dimension = trie.get_dimension();
+			const auto &top = trie.root->children;
+
+			// top-level subtrees are minimised independently, the first share directly
+			// into this automaton. Only freezing runs in parallel: the other shares are
+			// merged into the register one state at a time afterwards
+			size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), top.size()));
+			size_t size_per_thread = top.size() / std::max<size_t>(1, nthreads);
+			std::vector<std::unique_ptr<ArenaMFSA<TIndex>>> parts(nthreads);
+			std::vector<std::vector<std::pair<TIndex, state_id>>> roots(nthreads);
+			std::vector<std::future<void>> futures;
+			for(size_t i = 0; i != nthreads; i++)
+			{
+				size_t first = i * size_per_thread;
+				size_t last = i + 1 == nthreads ? top.size() : first + size_per_thread;
+				if(i > 0)
+					parts[i] = std::make_unique<ArenaMFSA<TIndex>>();
+				futures.emplace_back(std::async(std::launch::async, [first, last, &top, &part = i > 0 ? *parts[i] : *this, &r = roots[i]]()
+				{
+					for(size_t j = first; j != last; j++)
+						r.emplace_back(top[j]->index, part.freeze(top[j]));
+				}));
+			}
+			for(auto &i : futures)
+				i.get();
+
+			size_t state_number = states.size(), edge_number = edges.size();
+			for(size_t i = 1; i < nthreads; i++)
+			{
+				state_number += parts[i]->states.size();
+				edge_number += parts[i]->edges.size();
+			}
+			states.reserve(state_number + 1);
+			edges.reserve(edge_number + top.size());
+			eq.reserve(state_number + 1);
+
+			PendingState t;
+			t.accepting_state = top.empty();
+			t.count = trie.root->count;
+			for(const auto &j : roots.front())
+				t.edges.push_back(Edge{j.first, j.second});
+			for(size_t i = 1; i < nthreads; i++)
+			{
+				std::vector<state_id> ids(parts[i]->states.size(), pending);
+				for(const auto &j : roots[i])
+					t.edges.push_back(Edge{j.first, merge(*parts[i], j.second, ids)});
+				parts[i].reset();
+			}
+			std::sort(t.edges.begin(), t.edges.end(), [](const Edge &l, const Edge &r)
+			{
+				return l.label < r.label;
+			});
+			root = replace_or_register(t);
+			path.clear();
+			path.shrink_to_fit();
+			decltype(eq)(0, StateHasher{this}, StateEqual{this}).swap(eq);
+			finalized = true;
+			counted = true;
+			fill_mass();
+		}
+
+		template <typename TIndex>
+		bool ArenaMFSA<TIndex>::is_finalized() const
+		{
+			return finalized;
+		}
+
+		template <typename TIndex>
+		typename ArenaMFSA<TIndex>::state_id ArenaMFSA<TIndex>::get_root() const
+		{
+			return root;
+		}
+
+		template <typename TIndex>
+		const typename ArenaMFSA<TIndex>::State &ArenaMFSA<TIndex>::get_state(state_id id) const
+		{
+			return states[id];
+		}
+
+		template <typename TIndex>
+		const typename ArenaMFSA<TIndex>::Edge &ArenaMFSA<TIndex>::get_edge(state_id id, size_t k) const
+		{
+			return edges[states[id].first + k];
+		}
+
+		template <typename TIndex>
+		const typename ArenaMFSA<TIndex>::Edge *ArenaMFSA<TIndex>::get_edges(state_id id) const
+		{
+			return edges.data() + states[id].first;
+		}
+
+		template <typename TIndex>
+		size_t ArenaMFSA<TIndex>::get_mass(state_id id, size_t k) const
+		{
+			// count below the first k edges of the state
+			return k == 0 ? 0 : mass[states[id].first + k - 1];
+		}
+
+		template <typename TIndex>
+		size_t ArenaMFSA<TIndex>::get_node_count() const
+		{
+			return states.size() + path.size();
+		}
+
+		template <typename TIndex>
+		size_t ArenaMFSA<TIndex>::get_link_count() const
+		{
+			size_t count = edges.size();
+			for(const auto &i : path)
+				count += i.edges.size();
+			return count;
+		}
 	}
 }
 
@@ -19,8 +19,19 @@
 #define MVFF_H
 
 #include <mveqf/trie.h>
+#include <mveqf/thread_pool.h>
 #include <vector>
 #include <set>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <functional>
 
 namespace mveqf
 {
@@ -44,6 +55,217 @@ namespace mveqf
 				return dot < a.dot;
 			}
 		};
+		// cell ids in mixed radix over the grid cells, when the number of cells does
+		// not fit in 63 bits the ids are handed out in order of first appearance
+		// under a lock
+		class CellIndex
+		{
+		public:
+			explicit CellIndex(const std::vector<size_t> &in_radix) : radix(in_radix), stride(in_radix.size()), cells(1)
+			{
+				for(size_t i = radix.size(); i-- > 0;)
+				{
+					stride[i] = cells;
+					if(radix[i] != 0 && cells > (std::numeric_limits<std::uint64_t>::max() >> 1)/radix[i])
+					{
+						cells = std::numeric_limits<std::uint64_t>::max();
+						return;
+					}
+					cells *= radix[i];
+				}
+			}
+			std::uint64_t size() const
+			{
+				return cells;
+			}
+			std::uint64_t id(const std::vector<int> &point)
+			{
+				if(cells == std::numeric_limits<std::uint64_t>::max())
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto it = interned.emplace(point, interned.size());
+					if(it.second)
+						points.push_back(point);
+					return it.first->second;
+				}
+				std::uint64_t res = 0;
+				for(size_t i = 0; i != point.size(); i++)
+					res += static_cast<std::uint64_t>(point[i])*stride[i];
+				return res;
+			}
+			void point(std::uint64_t id, std::vector<int> &out) const
+			{
+				if(cells == std::numeric_limits<std::uint64_t>::max())
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					out = points[id];
+					return;
+				}
+				out.resize(radix.size());
+				for(size_t i = 0; i != radix.size(); i++)
+				{
+					out[i] = static_cast<int>(id/stride[i]);
+					id %= stride[i];
+				}
+			}
+		protected:
+			class PointHasher
+			{
+			public:
+				size_t operator()(const std::vector<int> &key) const
+				{
+					std::size_t seed = key.size();
+					for(auto &i : key)
+						seed ^= static_cast<size_t>(i) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+					return seed;
+				}
+			};
+			std::vector<size_t> radix;
+			std::vector<std::uint64_t> stride;
+			std::uint64_t cells;
+			std::unordered_map<std::vector<int>, std::uint64_t, PointHasher> interned;
+			std::vector<std::vector<int>> points;
+			mutable std::mutex mutex;
+		};
+
+		// set of cell ids: a bitset when the grid has at most dense_limit cells,
+		// otherwise an open-addressing hash set with linear probing
+		class CellSet
+		{
+		public:
+			static constexpr std::uint64_t dense_limit = std::uint64_t(1) << 26;
+
+			explicit CellSet(std::uint64_t cells) : dense(cells <= dense_limit), count(0)
+			{
+				if(dense)
+					bits.resize((cells + 63)/64, 0);
+				else
+					slots.resize(64, empty_slot);
+			}
+			bool contains(std::uint64_t id) const
+			{
+				if(dense)
+					return (bits[id >> 6] >> (id & 63)) & 1;
+				for(size_t i = hash(id) & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1))
+				{
+					if(slots[i] == id)
+						return true;
+					if(slots[i] == empty_slot)
+						return false;
+				}
+			}
+			// true if id was not in the set
+			bool insert(std::uint64_t id)
+			{
+				if(dense)
+				{
+					std::uint64_t mask = std::uint64_t(1) << (id & 63);
+					if(bits[id >> 6] & mask)
+						return false;
+					bits[id >> 6] |= mask;
+					++count;
+					return true;
+				}
+				if(2*(count + 1) > slots.size())
+					rehash(2*slots.size());
+				size_t i = hash(id) & (slots.size() - 1);
+				for(; slots[i] != empty_slot; i = (i + 1) & (slots.size() - 1))
+				{
+					if(slots[i] == id)
+						return false;
+				}
+				slots[i] = id;
+				++count;
+				return true;
+			}
+		protected:
+			static constexpr std::uint64_t empty_slot = std::numeric_limits<std::uint64_t>::max();
+			bool dense;
+			size_t count;
+			std::vector<std::uint64_t> bits;
+			std::vector<std::uint64_t> slots;
+
+			static size_t hash(std::uint64_t id)
+			{
+				id ^= id >> 33;
+				id *= 0xff51afd7ed558ccdULL;
+				id ^= id >> 33;
+				return static_cast<size_t>(id);
+			}
+			void rehash(size_t n)
+			{
+				std::vector<std::uint64_t> old(n, empty_slot);
+				old.swap(slots);
+				count = 0;
+				for(auto i : old)
+				{
+					if(i != empty_slot)
+						insert(i);
+				}
+			}
+		};
+
+		// CellSet shared by threads: atomic words when the grid is small enough for a
+		// bitset, otherwise hash sets split into shards with a lock each
+		class ConcurrentCellSet
+		{
+		public:
+			explicit ConcurrentCellSet(std::uint64_t cells) : dense(cells <= CellSet::dense_limit)
+			{
+				if(dense)
+				{
+					bits = std::vector<std::atomic<std::uint64_t>>((cells + 63)/64);
+					for(auto &i : bits)
+						i.store(0, std::memory_order_relaxed);
+				}
+				else
+				{
+					for(size_t i = 0; i != nshards; i++)
+						shards.emplace_back(new Shard(cells));
+				}
+			}
+			bool contains(std::uint64_t id) const
+			{
+				if(dense)
+					return (bits[id >> 6].load(std::memory_order_acquire) >> (id & 63)) & 1;
+				auto &shard = *shards[id % nshards];
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				return shard.set.contains(id);
+			}
+			// true for the one caller that added id
+			bool insert(std::uint64_t id)
+			{
+				if(dense)
+				{
+					std::uint64_t mask = std::uint64_t(1) << (id & 63);
+					return !(bits[id >> 6].fetch_or(mask, std::memory_order_acq_rel) & mask);
+				}
+				auto &shard = *shards[id % nshards];
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				return shard.set.insert(id);
+			}
+		protected:
+			struct Shard
+			{
+				explicit Shard(std::uint64_t cells) : set(cells) {}
+				std::mutex mutex;
+				CellSet set;
+			};
+			static constexpr size_t nshards = 64;
+			bool dense;
+			std::vector<std::atomic<std::uint64_t>> bits;
+			std::vector<std::unique_ptr<Shard>> shards;
+		};
+
+		// Flood fill from the cells pp over the cells whose density f exceeds the
+		// threshold. Every worker expands cells from its own deque, evaluates the
+		// unclaimed von Neumann neighbours and pushes the ones above the threshold
+		// back to its deque; an idle worker steals from the front of the others and
+		// sleeps until new work is pushed. The workers are tasks of pool, one per
+		// thread, by default a pool shared by all calls; f must not wait for tasks
+		// of that pool. A +1 neighbour is skipped if it is in samples, a -1
+		// neighbour if it has been expanded. The cells found are added to samples
+		// with counts multi*(f - min)/(max - min) + 1.
 		template <typename T>
 		void FloodFill_MultipleGrids_VonNeumann_trie(const std::vector<std::vector<T>> &grids,
 		    std::vector<std::vector<int>> &pp,
@@ -53,344 +275,213 @@ namespace mveqf
 		    size_t &fe_count,
 		    std::function<T(const std::vector<T> &)> f,
 		    const T threshold,
-		    const size_t multi)
+		    const size_t multi,
+		    std::shared_ptr<ThreadPool> pool = nullptr)
 
 		{
+			if(!pool)
+			{
+				static std::shared_ptr<ThreadPool> shared_pool = std::make_shared<ThreadPool>();
+				pool = shared_pool;
+			}
+			const size_t nthreads = pool->size();
 
-			bool multithread = true;
-			const auto nthreads = std::thread::hardware_concurrency();
-//    std::cout << "std::thread::hardware_concurrency " << nthreads << std::endl;
-
-			std::vector<T> fvalues;
-			std::vector<T> dot(grids.size());
-			std::map<std::vector<int>, T> fmap;
-
-			mveqf::TrieBased<mveqf::NodeCount<int>,int> visited;
-			mveqf::TrieBased<mveqf::NodeCount<int>,int> points;
-			mveqf::TrieBased<mveqf::NodeCount<int>,int> not_coumputed;
-			mveqf::TrieBased<mveqf::NodeCount<int>,int> ss;
+			std::vector<size_t> radix(grids.size());
+			for(size_t i = 0; i != grids.size(); i++)
+				radix[i] = grids[i].size() - 1;
+			CellIndex index(radix);
+			ConcurrentCellSet claimed(index.size());
+			ConcurrentCellSet expanded(index.size());
 
-			visited.set_dimension(grids.size());
-			points.set_dimension(grids.size());
-			not_coumputed.set_dimension(grids.size());
-			ss.set_dimension(grids.size());
+			struct WorkQueue
+			{
+				std::mutex mutex;
+				std::deque<std::uint64_t> tasks;
+			};
+			std::vector<WorkQueue> queues(nthreads);
+			std::atomic<size_t> outstanding(0);
+			std::atomic<size_t> evaluations(0);
+			std::atomic<bool> failed(false);
+			// bumped on every push and when the fill ends, idle workers wait for a change
+			std::mutex idle_mutex;
+			std::condition_variable idle;
+			size_t generation = 0;
+			auto wake = [&](bool all)
+			{
+				{
+					std::lock_guard<std::mutex> lock(idle_mutex);
+					++generation;
+				}
+				if(all)
+					idle.notify_all();
+				else
+					idle.notify_one();
+			};
 
-			for(const auto &start : pp)
+			for(size_t i = 0; i != pp.size(); i++)
 			{
-				points.insert(start);
-//        std::cout << "init points " << '\t' << start.front() << '\t' << start.back() << std::endl;
+				auto id = index.id(pp[i]);
+				if(expanded.insert(id))
+				{
+					queues[i % nthreads].tasks.push_back(id);
+					++outstanding;
+				}
 			}
-//    std::cout << std::endl;
-//    std::cin.get();
 			++fe_count;
 
-			T min = std::numeric_limits<T>::max();
-			T max = std::numeric_limits<T>::min();
+			// cells above the threshold with their values, per worker
+			std::vector<std::vector<std::pair<std::uint64_t, T>>> found(nthreads);
 
-			while(!points.empty() || !not_coumputed.empty())
+			auto pop = [&](size_t w, std::uint64_t &id)
 			{
-				while(!points.empty())
 				{
-					auto point = points.get_and_remove_last();
-					if(visited.search(point) || ss.search(point))
+					std::lock_guard<std::mutex> lock(queues[w].mutex);
+					if(!queues[w].tasks.empty())
 					{
-						continue;
+						id = queues[w].tasks.back();
+						queues[w].tasks.pop_back();
+						return true;
 					}
-					ss.insert(point);
-
-					auto init_point = point;
-					for(size_t i = 0; i != point.size(); i++)
-					{
-						point = init_point;
-						point[i] = point[i] + 1;
-
-						if(point[i] < 0 || point[i] > static_cast<int>(grids[i].size() - 2))
-						{
-//                    std::cout << "here " << point[i] << std::endl;
-							continue;
-						}
-
-						if(!visited.search(point) && !samples->search(point))
-						{
-//                    std::cout << "insert " << point.front() << '\t' << point.back() << std::endl;
-							not_coumputed.insert(point);
-						}
-					}
-					for(size_t i = 0; i != point.size(); i++)
+				}
+				for(size_t k = 1; k != nthreads; k++)
+				{
+					auto &victim = queues[(w + k) % nthreads];
+					std::lock_guard<std::mutex> lock(victim.mutex);
+					if(!victim.tasks.empty())
 					{
-						point = init_point;
-						point[i] = point[i] - 1;
-
-						if(point[i] < 0 || point[i] > static_cast<int>(grids[i].size() - 2))
-						{
-//                    std::cout << "here " << point[i] << std::endl;
-							continue;
-						}
-
-						if(!visited.search(point) && !ss.search(point))
-						{
-//                    std::cout << "insert " << point.front() << '\t' << point.back() << std::endl;
-							not_coumputed.insert(point);
-						}
+						id = victim.tasks.front();
+						victim.tasks.pop_front();
+						return true;
 					}
 				}
+				return false;
+			};
 
-				size_t number_to_points = 0;
-				while(!not_coumputed.empty())
+			auto worker = [&](size_t w)
+			{
+				std::vector<int> init_point, point;
+				std::vector<T> values(grids.size());
+				auto evaluate = [&](std::uint64_t id)
 				{
-					if(!multithread)
+					for(size_t j = 0; j != values.size(); j++)
+						values[j] = grids[j][point[j]] + dx[j];
+					T value = f(values);
+					++evaluations;
+					if(value > threshold)
 					{
-						auto point = not_coumputed.get_and_remove_last();
-						std::vector<T> values(point.size());
-						for(size_t j = 0; j != values.size(); j++)
+						found[w].emplace_back(id, value);
+						if(expanded.insert(id))
 						{
-							values[j] = grids[j][point[j]] + dx[j];
-						}
-						T value = f(values);
-
-						++fe_count;
-
-						if(value > threshold)
-						{
-							++number_to_points;
-							points.insert(point);
-							fvalues.push_back(value);
-							fmap.insert(std::make_pair(point, value));
-							if(min > value)
-								min = value;
-							if(max < value)
-								max = value;
-						}
-						else
-						{
-							visited.insert(point);
+							++outstanding;
+							{
+								std::lock_guard<std::mutex> lock(queues[w].mutex);
+								queues[w].tasks.push_back(id);
+							}
+							wake(false);
 						}
 					}
-					else
+				};
+				try
+				{
+					std::uint64_t id;
+					while(!failed)
 					{
-
-						std::vector<cell<int,T>> to_compute;
-						for(size_t i = 0; i != nthreads*10000000; i++)
+						size_t seen;
 						{
-							if(not_coumputed.empty())
-								break;
-
-							auto point = not_coumputed.get_and_remove_last();
-							to_compute.push_back(cell<int,T>(point, -1));
+							std::lock_guard<std::mutex> lock(idle_mutex);
+							seen = generation;
 						}
-
-
-						auto first = to_compute.begin();
-						auto last = to_compute.end();
-						const auto size = last - first;
-						const auto size_per_thread = size / nthreads;
-
-						std::vector<std::future<void>> futures;
-						for(unsigned int i = 0; i < nthreads - 1; i++)
+						if(!pop(w, id))
 						{
-							futures.emplace_back(std::async([start = first + i * size_per_thread, size_per_thread, &to_compute, &grids, &dx, f]()
+							std::unique_lock<std::mutex> lock(idle_mutex);
+							idle.wait(lock, [&]()
 							{
-								for(auto it = start; it != start + size_per_thread; ++it)
-								{
-									size_t i = std::distance(to_compute.begin(), it);
-									std::vector<T> values(to_compute[i].dot.size());
-									for(size_t j = 0; j != values.size(); j++)
-									{
-										values[j] = grids[j][to_compute[i].dot[j]] + dx[j];
-									}
-									to_compute[i].value = f(values);
-								}
-							}));
+								return generation != seen || outstanding == 0 || failed;
+							});
+							if(outstanding == 0)
+								return;
+							continue;
 						}
-						futures.emplace_back(
-						  std::async([start = first + (nthreads - 1) * size_per_thread, last, &to_compute, &grids, &dx, f]()
-						{
-							for(auto it = start; it != last; ++it)
-							{
-								size_t i = std::distance(to_compute.begin(), it);
-								std::vector<T> values(to_compute[i].dot.size());
-								for(size_t j = 0; j != values.size(); j++)
-								{
-									values[j] = grids[j][to_compute[i].dot[j]] + dx[j];
-								}
-								to_compute[i].value = f(values);
-							}
-
-						}));
-
-						for(auto &&future : futures)
+						index.point(id, init_point);
+						for(size_t i = 0; i != init_point.size(); i++)
 						{
-							if(future.valid())
-							{
-								future.get();
-							}
-							else
-							{
-								throw std::runtime_error("Something going wrong.");
-							}
+							point = init_point;
+							point[i] = point[i] + 1;
+							if(point[i] > static_cast<int>(grids[i].size() - 2))
+								continue;
+							if(samples->search(point))
+								continue;
+							auto neighbour = index.id(point);
+							if(claimed.insert(neighbour))
+								evaluate(neighbour);
 						}
-						for(size_t i = 0; i != to_compute.size(); i++)
+						for(size_t i = 0; i != init_point.size(); i++)
 						{
-							if(to_compute[i].value > threshold)
-							{
-								points.insert(to_compute[i].dot);
-								fvalues.push_back(to_compute[i].value);
-								fmap.insert(std::make_pair(to_compute[i].dot, to_compute[i].value));
-								++number_to_points;
-
-								if(min > to_compute[i].value)
-									min = to_compute[i].value;
-								if(max < to_compute[i].value)
-									max = to_compute[i].value;
-							}
-							else
-							{
-								visited.insert(to_compute[i].dot);
-							}
+							point = init_point;
+							point[i] = point[i] - 1;
+							if(point[i] < 0)
+								continue;
+							auto neighbour = index.id(point);
+							if(!expanded.contains(neighbour) && claimed.insert(neighbour))
+								evaluate(neighbour);
 						}
+						if(--outstanding == 0)
+							wake(true);
 					}
 				}
-				//std::cout << number_to_points << std::endl;
-			}
-			counter = 0;
-			visited.remove_tree();
-			points.remove_tree();
-			not_coumputed.remove_tree();
+				catch(...)
+				{
+					failed = true;
+					wake(true);
+					throw;
+				}
+			};
 
-//    T delta = std::numeric_limits<T>::max();
-//    std::sort(fvalues.begin(), fvalues.end());
-//    for(size_t j = 1; j != fvalues.size(); j++)
-//    {
-//        T temp = fvalues[j] - fvalues[j - 1];
-//        if(temp > 0 && delta > temp)
-//            delta = temp;
-//    }
-//    std::cout << std::scientific << delta << std::endl;
-//
-//    delta = 1.0/delta;
+			std::vector<std::future<void>> futures;
+			for(size_t w = 0; w != nthreads; w++)
+				futures.emplace_back(pool->submit([&worker, w]()
+				{
+					worker(w);
+				}));
+			// the workers refer to the locals, so all of them end before a rethrow
+			for(auto &&future : futures)
+				future.wait();
+			for(auto &&future : futures)
+				future.get();
+			fe_count += evaluations;
 
-			/*while(!ss.empty())
+			T min = std::numeric_limits<T>::max();
+			T max = std::numeric_limits<T>::min();
+			std::vector<std::pair<std::uint64_t, T>> cells;
+			for(auto &i : found)
 			{
-			    std::vector<cell<int,T>> to_compute;
-			    for(size_t i = 0; i != nthreads*10000000; i++)
-			    {
-			        if(ss.empty())
-			            break;
-
-			        auto point = ss.get_and_remove_last();
-			        to_compute.push_back(cell<int,T>(point, -1));
-			    }
-
-
-			    auto first = to_compute.begin();
-			    auto last = to_compute.end();
-			    const auto size = last - first;
-			    const auto size_per_thread = size / nthreads;
-
-			    std::vector<std::future<void>> futures;
-			    for(unsigned int i = 0; i < nthreads - 1; i++)
-			    {
-			        futures.emplace_back(std::async([start = first + i * size_per_thread, size_per_thread, &to_compute, &grids, &dx, f]()
-			        {
-			            for(auto it = start; it != start + size_per_thread; ++it)
-			            {
-			                size_t i = std::distance(to_compute.begin(), it);
-			                std::vector<T> values(to_compute[i].dot.size());
-			                for(size_t j = 0; j != values.size(); j++)
-			                {
-			                    values[j] = grids[j][to_compute[i].dot[j]] + dx[j];
-			                }
-			                to_compute[i].value = f(values);
-			            }
-			        }));
-			    }
-			    futures.emplace_back(
-			        std::async([start = first + (nthreads - 1) * size_per_thread, last, &to_compute, &grids, &dx, f]()
-			    {
-			        for(auto it = start; it != last; ++it)
-			        {
-			            size_t i = std::distance(to_compute.begin(), it);
-			            std::vector<T> values(to_compute[i].dot.size());
-			            for(size_t j = 0; j != values.size(); j++)
-			            {
-			                values[j] = grids[j][to_compute[i].dot[j]] + dx[j];
-			            }
-			            to_compute[i].value = f(values);
-			        }
-			    }));
+				for(auto &j : i)
+				{
+					cells.push_back(j);
+					if(min > j.second)
+						min = j.second;
+					if(max < j.second)
+						max = j.second;
+				}
+			}
+			std::sort(cells.begin(), cells.end(), [](const auto &l, const auto &r)
+			{
+				return l.first < r.first;
+			});
 
-			    for(auto &&future : futures)
-			    {
-			        if(future.valid())
-			        {
-			            future.get();
-			        }
-			        else
-			        {
-			            throw std::runtime_error("Something going wrong.");
-			        }
-			    }
-			    for(size_t i = 0; i != to_compute.size(); i++)
-			    {
-			        //samples->insert(to_compute[i].dot, std::round(delta*to_compute[i].value) + 1);
-			        to_compute[i].value = (to_compute[i].value - min)/(max - min);
-			        samples->insert(to_compute[i].dot, 1000*to_compute[i].value + 1);
-			    }
-			}*/
-//    std::cout << ss.get_total_count() << std::endl;
-//    std::cout << fmap.size() << std::endl;
+			counter = 0;
 			size_t count = 0;
-//    for(const auto & i : fmap)
-//    {
-//        if(ss.search(i.first))
-//        {
-//            T val = (i.second - min)/(max - min);
-//            samples->insert(i.first, 1000*val + 1);
-//            ++count;
-//        }
-//    }
-			while(!ss.empty())
+			std::vector<int> point;
+			for(const auto &i : cells)
 			{
-				auto point = ss.get_and_remove_last();
-				auto it = fmap.find(point);
-
-//        for(size_t i = 0; i != point.size(); i++)
-//        {
-//            if(point[i] < 0 || point[i] > static_cast<int>(grids[i].size() - 2))
-//            {
-//                std::cout << "what??" << std::endl;
-//            }
-//        }
-//        std::vector<T> values(point.size());
-//        for(size_t j = 0; j != values.size(); j++)
-//        {
-//            values[j] = grids[j][point[j]] + dx[j];
-//            if(values[j] > grids[j].back())
-//            {
-//                std::cout << "wow!! " << values[j] << std::endl;
-//            }
-//        }
-
-
-
-				if(it != fmap.end())
+				index.point(i.first, point);
+				T val = (i.second - min)/(max - min);
+				if(!samples->search(point))
 				{
-					T val = (it->second - min)/(max - min);
-					if(!samples->search(point))
-					{
-						samples->insert(it->first, multi*val + 1);
-						++count;
-					}
-
-//            for(size_t i = 0; i != point.size(); i++)
-//            {
-//                std::cout << point[i] << '\t';
-//            }
-//            std::cout << std::endl;
+					samples->insert(point, multi*val + 1);
+					++count;
 				}
 			}
-//    std::cout << count << '\t' << grids.front().size() << '\t' << grids.back().size() << std::endl;
-
 
 			if(!count)
 			{
@@ -398,9 +489,7 @@ namespace mveqf
 					if(!samples->search(pp[i]))
 						samples->insert(pp[i], 1);
 			}
-
 		}
-
 	}
 
 }
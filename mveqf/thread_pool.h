@@ -0,0 +1,122 @@
+/**************************************************************************
+
+   Copyright © 2020 Sergey Poluyan <svpoluyan@gmail.com>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+**************************************************************************/
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <type_traits>
+
+namespace mveqf
+{
+	// fixed set of worker threads living as long as the pool, tasks are run in
+	// submission order; a task must not wait for another task of the same pool
+	class ThreadPool
+	{
+	public:
+		explicit ThreadPool(size_t nthreads = std::thread::hardware_concurrency());
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		~ThreadPool();
+
+		template <typename F>
+		std::future<std::invoke_result_t<F>> submit(F f);
+		size_t size() const;
+	protected:
+		std::vector<std::thread> workers;
+		std::queue<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool stop;
+
+		void work();
+	};
+
+	inline ThreadPool::ThreadPool(size_t nthreads) : stop(false)
+	{
+		if(nthreads == 0)
+			nthreads = 1;
+		workers.reserve(nthreads);
+		for(size_t i = 0; i != nthreads; i++)
+			workers.emplace_back(&ThreadPool::work, this);
+	}
+
+	inline ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		condition.notify_all();
+		for(auto &i : workers)
+			i.join();
+	}
+
+	inline size_t ThreadPool::size() const
+	{
+		return workers.size();
+	}
+
+	inline void ThreadPool::work()
+	{
+		while(true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [this]()
+				{
+					return stop || !tasks.empty();
+				});
+				if(stop && tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+	template <typename F>
+	std::future<std::invoke_result_t<F>> ThreadPool::submit(F f)
+	{
+		typedef std::invoke_result_t<F> result_type;
+		auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(f));
+		std::future<result_type> res = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(stop)
+				throw std::runtime_error("submit on a stopped ThreadPool");
+			tasks.emplace([task]()
+			{
+				(*task)();
+			});
+		}
+		condition.notify_one();
+		return res;
+	}
+}
+
+#endif